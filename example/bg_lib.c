@@ -331,6 +331,23 @@ void* memmove(void* dest, const void* src, size_t count)
     return dest;
 }
 
+void* calloc(size_t count, size_t size)
+{
+    void* p;
+
+    if (size != 0 && count > INT_MAX / size)
+    {
+        return NULL;
+    }
+    /* memory of the heap is reused after heapreset, so clear it */
+    p = malloc(count * size);
+    if (p)
+    {
+        memset(p, 0, count * size);
+    }
+    return p;
+}
+
 static int randSeed = 0;
 
 void srand(unsigned seed)
@@ -56,6 +56,13 @@ void* memmove(void* dest, const void* src, size_t count);
 void* memset(void* dest, int c, size_t count);
 void* memcpy(void* dest, const void* src, size_t count);
 
+// Heap functions, need a heap from the host (vmCreateOptions_t::heapSize)
+void* malloc(size_t size); /* system call */
+void* calloc(size_t count, size_t size);
+int heapmark(void);        /* system call */
+void heapreset(int mark);  /* system call */
+void heapfreeall(void);    /* system call */
+
 // Math functions
 int abs(int n);
 double fabs(double x);
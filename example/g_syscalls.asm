@@ -4,4 +4,8 @@ equ	trap_Printf				-1
 equ	trap_Error				-2
 equ	memset					-3
 equ	memcpy					-4
+equ	malloc					-5
+equ	heapmark				-6
+equ	heapreset				-7
+equ	heapfreeall				-8
 
@@ -13,30 +13,70 @@
    This file can be used as a template to integrate the VM in your application.
 */
 
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200112L /* mmap with -std=c89 */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define USE_MMAP /* map the .qvm file instead of reading it */
+#endif
+
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "vm.h"
 
 /* The compiled bytecode calls native functions, defined in this file.
  * Read README.md section "How to add a custom native function" for
- * details.
+ * details. This callback gets all syscalls without an entry in
+ * syscallTable.
  * @param[in,out] vm Pointer to virtual machine, prepared by VM_Create.
  * @param[in,out] args Array with arguments of function call.
  * @return Return value handed back to virtual machine. */
 intptr_t systemCalls(vm_t* vm, intptr_t* args);
 
-/* Load an image from a file. Data is allocated with malloc.
-   Call free() to unload image.
+/* Native functions of g_syscalls.asm, same arguments as systemCalls */
+static intptr_t trapPrintf(vm_t* vm, intptr_t* args);
+static intptr_t trapError(vm_t* vm, intptr_t* args);
+
+/* Handlers and their number of arguments, indexed by -1 - (the number in
+ * g_syscalls.asm). See VM_SetSystemCalls. memset, memcpy and the heap
+ * functions are built into the VM. */
+static const vmSystemCallEntry_t syscallTable[] = {
+    {trapPrintf, 1, VM_INTRINSIC_NONE},  /* -1: PRINTF */
+    {trapError, 1, VM_INTRINSIC_NONE},   /* -2: ERROR */
+    {NULL, 3, VM_INTRINSIC_MEMSET},      /* -3: MEMSET */
+    {NULL, 3, VM_INTRINSIC_MEMCPY},      /* -4: MEMCPY */
+    {NULL, 1, VM_INTRINSIC_MALLOC},      /* -5: MALLOC */
+    {NULL, 0, VM_INTRINSIC_HEAPMARK},    /* -6: HEAPMARK */
+    {NULL, 1, VM_INTRINSIC_HEAPRESET},   /* -7: HEAPRESET */
+    {NULL, 0, VM_INTRINSIC_HEAPFREEALL}, /* -8: HEAPFREEALL */
+};
+
+/* Load an image from a file. The file is mapped read-only if mmap is
+   available, otherwise the data is allocated with malloc.
+   Call unloadImage() to unload the image. VM_Create doesn't need the
+   image anymore once it returns.
    @param[in] filepath Path to virtual machine binary file.
    @param[out] size File size in bytes is written to this memory location.
    @return Pointer to virtual machine image file (raw bytes). */
 uint8_t* loadImage(const char* filepath, int* size);
 
+/* Release an image from loadImage().
+   @param[in] image Pointer to virtual machine image file.
+   @param[in] size File size in bytes from loadImage(). */
+void unloadImage(uint8_t* image, int size);
+
+/* Bytes of heap for malloc in the bytecode */
+#define HEAP_SIZE (1024 * 1024)
+
 int main(int argc, char** argv)
 {
-    vm_t vm;
-    int  retVal = -1;
-    int  imageSize;
+    vm_t              vm;
+    vmCreateOptions_t options = {0};
+    int               retVal  = -1;
+    int               imageSize;
 
     if (argc < 2)
     {
@@ -53,15 +93,20 @@ int main(int argc, char** argv)
     }
 
     /* set-up virtual machine */
-    if (VM_Create(&vm, filepath, image, imageSize, systemCalls) == 0)
+    options.heapSize  = HEAP_SIZE;
+    const int created = (VM_CreateWithOptions(&vm, filepath, image, imageSize,
+                                              systemCalls, &options) == 0);
+    unloadImage(image, imageSize); /* the vm has its own code and data now */
+    if (created)
     {
+        VM_SetSystemCalls(&vm, syscallTable,
+                          sizeof(syscallTable) / sizeof(syscallTable[0]));
         /* call virtual machine vmMain() with integer argument (here 0) */
         retVal = VM_Call(&vm, 0);
     }
     /* output profile information in DEBUG_VM build: */
     /* VM_VmProfile_f(&vm); */
     VM_Free(&vm);
-    free(image); /* we can release the memory now */
 
     return retVal;
 }
@@ -98,6 +143,40 @@ void Com_free(void* p, vm_t* vm, vmMallocType_t type)
     free(p);
 }
 
+#ifdef USE_MMAP
+uint8_t* loadImage(const char* filepath, int* size)
+{
+    struct stat st;    /* to get the file size */
+    void*       image; /* mapped bytecode */
+    int         fd;    /* bytecode input file */
+
+    *size = 0;
+    fd    = open(filepath, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to open file %s.\n", filepath);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < 1 || st.st_size > INT_MAX)
+    {
+        close(fd);
+        return NULL;
+    }
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); /* the mapping stays valid */
+    if (image == MAP_FAILED)
+    {
+        return NULL;
+    }
+    *size = (int)st.st_size;
+    return (uint8_t*)image;
+}
+
+void unloadImage(uint8_t* image, int size)
+{
+    munmap(image, size);
+}
+#else
 uint8_t* loadImage(const char* filepath, int* size)
 {
     FILE*    f;            /* bytecode input file */
@@ -140,36 +219,26 @@ uint8_t* loadImage(const char* filepath, int* size)
     return image;
 }
 
-intptr_t systemCalls(vm_t* vm, intptr_t* args)
+void unloadImage(uint8_t* image, int size)
 {
-    const int id = -1 - args[0];
+    (void)size;
+    free(image);
+}
+#endif
 
-    switch (id)
-    {
-    case -1: /* PRINTF */
-        return printf("%s", (const char*)VMA(1, vm));
-
-    case -2: /* ERROR */
-        return fprintf(stderr, "%s", (const char*)VMA(1, vm));
-
-    case -3: /* MEMSET */
-        if (VM_MemoryRangeValid(args[1] /*addr*/, args[3] /*len*/, vm) == 0)
-        {
-            memset(VMA(1, vm), args[2], args[3]);
-        }
-        return args[1];
-
-    case -4: /* MEMCPY */
-        if (VM_MemoryRangeValid(args[1] /*addr*/, args[3] /*len*/, vm) == 0 &&
-            VM_MemoryRangeValid(args[2] /*addr*/, args[3] /*len*/, vm) == 0)
-        {
-            memcpy(VMA(1, vm), VMA(2, vm), args[3]);
-        }
-        return args[1];
-
-    default:
-        fprintf(stderr, "Bad system call: %i\n", id);
-    }
+intptr_t systemCalls(vm_t* vm, intptr_t* args)
+{
+    (void)vm;
+    fprintf(stderr, "Bad system call: %i\n", (int)(-1 - args[0]));
     return 0;
 }
 
+static intptr_t trapPrintf(vm_t* vm, intptr_t* args)
+{
+    return printf("%s", (const char*)VMA(1, vm));
+}
+
+static intptr_t trapError(vm_t* vm, intptr_t* args)
+{
+    return fprintf(stderr, "%s", (const char*)VMA(1, vm));
+}
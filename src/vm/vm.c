@@ -13,7 +13,14 @@
  * SYSTEM INCLUDE FILES
  ******************************************************************************/
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* MAP_ANONYMOUS with -std=c89 */
+#endif
+
+#include <math.h> /* intrinsics: sqrt, sin, cos, floor */
 #include <stdarg.h>
+#include <stddef.h> /* offsetof */
+#include <stdlib.h> /* qsort */
 
 /******************************************************************************
  * PROJECT INCLUDE FILES
@@ -28,15 +35,6 @@
 /** Virtual machine op stack size in bytes */
 #define OPSTACK_SIZE 1024
 
-/** Max number of arguments to pass from a vm to engine's syscall handler
- * function for the vm.
- * syscall number + 15 arguments */
-#define MAX_VMSYSCALL_ARGS 16
-
-/** Max number of arguments to pass from engine to vm's vmMain function.
- * command number + 12 arguments */
-#define MAX_VMMAIN_ARGS 13
-
 /** Macro to read 32-bit little endian value (from the .qvm file) and convert it
  * to the host byte order */
 #define LittleLong(x) LittleEndianToHost((const uint8_t*)&(x))
@@ -75,14 +73,107 @@
 #endif
 #endif
 
+/* Direct threading: with computed gotos the code image is translated at load
+ * time to an image where every op code is replaced by the address of its
+ * handler. Dispatching is then a single indirect jump, without the lookup
+ * in the dispatch table. The operands stay at the same index, so jump
+ * targets are the same as for the int code image.
+ * Define VM_NO_DIRECT_THREADING to use the dispatch table. */
+#ifdef USE_COMPUTED_GOTOS
+#ifndef VM_NO_DIRECT_THREADING
+#define USE_DIRECT_THREADING /**< dispatch with handler addresses */
+#endif
+#endif
+
+/* The x86-64 JIT translates the bytecode at load time to native code.
+ * Only the System V calling convention (Linux, BSD, macOS) is supported. The
+ * interpreter is used on all other hosts and in DEBUG_VM builds. */
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(DEBUG_VM) &&         \
+    !defined(VM_NO_JIT)
+#define USE_JIT_X64 /**< compile bytecode to x86-64 machine code */
+#include <sys/mman.h>
+#endif
+
+/* On Linux the initial data segment of a module is kept in an anonymous
+ * memory file. VM_CreateInstance maps it copy-on-write: a new instance costs
+ * one mmap call and only the pages it writes to are copied. Small segments
+ * are faster to copy than to map, see VM_COW_MIN_LENGTH.
+ * Define VM_NO_COW_INSTANCES to always copy the data segment. */
+#if defined(__linux__) && !defined(VM_NO_COW_INSTANCES)
+#include <sys/mman.h>
+#include <unistd.h> /* ftruncate, pwrite, sysconf */
+#ifdef MFD_CLOEXEC   /* memfd_create is available */
+#define USE_COW_INSTANCES /**< map instance data segments copy-on-write */
+#endif
+#endif
+
+#ifndef VM_COW_MIN_LENGTH
+/** Min. data segment size in bytes to map instances copy-on-write. Below
+ * about 256 KiB the mmap and page faults cost more than a copy. */
+#define VM_COW_MIN_LENGTH 262144
+#endif
+
+/* VM_Create keeps the prepared code (expanded code, instruction table,
+ * threaded code and native code) in a global cache, so all VMs loaded from
+ * the same code segment share it. The cache is protected by a spin lock with
+ * the GCC atomic builtins. Define VM_NO_CODE_CACHE to disable the cache. */
+#if defined(__GNUC__) && !defined(VM_NO_CODE_CACHE)
+#define USE_CODE_CACHE /**< share prepared code between VMs */
+#endif
+
+/* VMs created with vmCreateOptions_t::pooled allocate their code and data
+ * buffers from a global pool. VM_Free keeps up to VM_POOL_MAX_BLOCKS buffers
+ * per type and size class for the next VM_Create, there are 4 size classes
+ * per power of 2. The pool is protected by a spin lock with the GCC atomic
+ * builtins. Define VM_NO_ALLOC_POOL to disable it: then pooled VMs use
+ * Com_malloc and Com_free like all other VMs. */
+#if defined(__GNUC__) && !defined(VM_NO_ALLOC_POOL)
+#define USE_ALLOC_POOL /**< recycle the buffers of pooled VMs */
+#endif
+
+#ifndef VM_POOL_MAX_BLOCKS
+/** Max. free buffers per type and size class in the pool */
+#define VM_POOL_MAX_BLOCKS 4
+#endif
+
+/* Guard pages: define VM_GUARD_PAGES to reserve 4 GiB of address space with
+ * PROT_NONE after every data segment. Only the exact size of the segment is
+ * accessible, so a load or store with any 32-bit address either hits the
+ * segment or faults in the reservation. The interpreter and the JIT then
+ * don't mask the addresses, and the data segment isn't rounded up to a power
+ * of 2. The fault is caught by a SIGSEGV handler and aborts the VM call with
+ * VM_DATA_OUT_OF_RANGE. Needs a 64-bit POSIX host. The data segments are
+ * mapped by the VM, not allocated with Com_malloc. */
+#if defined(VM_GUARD_PAGES) && defined(__GNUC__) && defined(__LP64__) &&    \
+    (defined(__linux__) || defined(__APPLE__))
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h> /* sysconf */
+#define USE_GUARD_PAGES /**< catch out of range accesses with guard pages */
+/** Number of bytes reserved for a data segment with guard pages: every
+ * 32-bit address, plus the bytes of a 4 byte access at the end */
+#define VM_GUARD_LENGTH (((size_t)1 << 32) + 65536)
+#endif
+
+/* Bounds check: define VM_BOUNDS_CHECK to compare the address of every load
+ * and store with the length of the data segment instead of masking it. The
+ * data segment then has its exact size instead of the next power of 2, an
+ * access out of range aborts the call with VM_DATA_OUT_OF_RANGE. Costs a
+ * compare and a branch per access, see "make benchmark". Guard pages don't
+ * need the check. */
+#if defined(VM_BOUNDS_CHECK) && !defined(USE_GUARD_PAGES)
+#define USE_BOUNDS_CHECK /**< compare data addresses with dataLength */
+#endif
+
+/** Max. native stack in bytes for calls inside of JIT code */
+#define JIT_NATIVE_STACK_SIZE (2 * VM_PROGRAM_STACK_SIZE)
+
 /** Max. number of op codes in op codes table */
-#define OPCODE_TABLE_SIZE 64
+#define OPCODE_TABLE_SIZE VM_OPCODE_COUNT
 /** Mask for a valid opcode (so no one can escape the sandbox) */
 #define OPCODE_TABLE_MASK (OPCODE_TABLE_SIZE - 1)
 
-/** Max. size of BSS section */
-#define VM_MAX_BSS_LENGTH 10485760
-
 /******************************************************************************
  * TYPEDEFS
  ******************************************************************************/
@@ -174,7 +265,36 @@ typedef enum {
     OP_CVIF, /* Convert to integer from float */
     OP_CVFI, /* Convert to float from integer */
 
-    OP_MAX /* Make this the last item */
+    OP_MAX, /* Make this the last item of the bytecode op codes */
+
+    /* Superinstructions. Only created by VM_FuseInstructions, never valid in
+       a .qvm file. The instructions of the original sequence remain in the
+       code image after the fused op code, so that jumps into the middle of a
+       sequence still work. */
+    OP_LOCAL_LOAD4 = OP_MAX, /* OP_LOCAL, OP_LOAD4 */
+    OP_LOCAL_CONST_STORE4,   /* OP_LOCAL, OP_CONST, OP_STORE4 */
+    OP_CONST_ADD,            /* OP_CONST, OP_ADD */
+    OP_CONST_JUMP,           /* OP_CONST, OP_JUMP */
+    OP_CONST_EQ,             /* OP_CONST, OP_EQ */
+    OP_CONST_NE,             /* OP_CONST, OP_NE */
+    OP_CONST_LTI,            /* OP_CONST, OP_LTI */
+    OP_CONST_LEI,            /* OP_CONST, OP_LEI */
+    OP_CONST_GTI,            /* OP_CONST, OP_GTI */
+    OP_CONST_GEI,            /* OP_CONST, OP_GEI */
+    OP_CONST_LTU,            /* OP_CONST, OP_LTU */
+    OP_CONST_LEU,            /* OP_CONST, OP_LEU */
+    OP_CONST_GTU,            /* OP_CONST, OP_GTU */
+    OP_CONST_GEU,            /* OP_CONST, OP_GEU */
+    OP_CONST_CALL,           /* OP_CONST, OP_CALL (only if verified) */
+
+    OP_FUSED_MAX, /* Make this the last item of the superinstructions */
+
+    /* Counts the instruction for VM_Profile, then runs the op code from
+       vm->codeBase. Only in the code image of the profiler. */
+    OP_PROFILE = OP_FUSED_MAX,
+    /* Takes one from the budget of VM_SetBudget, then runs the op code from
+       vm->codeBase. Only in the code image of the budget. */
+    OP_BUDGET
 } opcode_t;
 
 #ifndef USE_COMPUTED_GOTOS
@@ -240,6 +360,169 @@ typedef enum {
 #define goto_OP_MULF case OP_MULF
 #define goto_OP_CVIF case OP_CVIF
 #define goto_OP_CVFI case OP_CVFI
+#define goto_OP_LOCAL_LOAD4 case OP_LOCAL_LOAD4
+#define goto_OP_LOCAL_CONST_STORE4 case OP_LOCAL_CONST_STORE4
+#define goto_OP_CONST_ADD case OP_CONST_ADD
+#define goto_OP_CONST_JUMP case OP_CONST_JUMP
+#define goto_OP_CONST_EQ case OP_CONST_EQ
+#define goto_OP_CONST_NE case OP_CONST_NE
+#define goto_OP_CONST_LTI case OP_CONST_LTI
+#define goto_OP_CONST_LEI case OP_CONST_LEI
+#define goto_OP_CONST_GTI case OP_CONST_GTI
+#define goto_OP_CONST_GEI case OP_CONST_GEI
+#define goto_OP_CONST_LTU case OP_CONST_LTU
+#define goto_OP_CONST_LEU case OP_CONST_LEU
+#define goto_OP_CONST_GTU case OP_CONST_GTU
+#define goto_OP_CONST_GEU case OP_CONST_GEU
+#define goto_OP_CONST_CALL case OP_CONST_CALL
+#define goto_OP_PROFILE case OP_PROFILE
+#define goto_OP_BUDGET case OP_BUDGET
+#endif
+
+#ifdef USE_CODE_CACHE
+/** Prepared code of a module in the code cache. Shared by all VMs that were
+ * created from the same code segment (and the same data mask: the native
+ * code depends on it). */
+typedef struct vmCodeImage_s
+{
+    struct vmCodeImage_s* next; /**< Linked list of cached images */
+
+    int      refCount;         /**< Number of VMs using this image */
+    uint32_t hash;             /**< Hash of the code segment */
+    int      codeLength;       /**< Bytes in the code segment */
+    int      instructionCount; /**< Number of instructions */
+    int      dataLength;       /**< vm->dataLength of the VMs */
+    int      stackSize;        /**< vm->stackSize of the VMs */
+    int      pooled;           /**< vm->pooled: the pool owns the code */
+
+    uint8_t*  codeBase;            /**< vm->codeBase */
+    intptr_t* instructionPointers; /**< vm->instructionPointers */
+    intptr_t* threadedCode;        /**< vm->threadedCode */
+    int       fusionCount;         /**< vm->fusionCount */
+    int       verified;            /**< vm->verified */
+    int       compiled;            /**< vm->compiled */
+    uint8_t*  jitCode;             /**< vm->jitCode */
+    size_t    jitCodeLength;       /**< vm->jitCodeLength */
+
+    uint8_t code[1]; /**< Copy of the code segment to compare. Variable sized,
+                        space is reserved by malloc. */
+} vmCodeImage_t;
+#endif
+
+#ifdef USE_ALLOC_POOL
+/** Number of size classes of the pool: 4 per power of 2 from 256 bytes on,
+ * larger buffers are not kept. */
+#define VM_POOL_CLASSES 96
+
+/** Header in front of every buffer of a pooled VM. 16 bytes, so the buffer
+ * keeps the alignment of Com_malloc. */
+typedef union vmPoolBlock_u
+{
+    struct
+    {
+        union vmPoolBlock_u* next; /**< Next free block of the size class */
+        int sizeClass; /**< Index of the size class, -1 if not kept */
+    } s;
+    uint8_t align[16]; /**< Size of the header */
+} vmPoolBlock_t;
+#endif
+
+/** Max. call depth for the inclusive instruction counts of VM_Profile.
+ * Deeper calls only count for the calls and exclusive instructions. The
+ * call stack samples are cut off at this depth, too. */
+#define VM_PROFILE_MAX_DEPTH 256
+
+/** Max. number of different call stacks of VM_ProfileSampling. Samples of
+ * new call stacks beyond this count for the longest known part. */
+#define VM_PROFILE_MAX_NODES 4096
+
+/** Node of the call tree of VM_ProfileSampling: one for every call stack
+ * that was sampled, node 0 is the root. */
+typedef struct
+{
+    int      function; /**< Function index, -1 for the root */
+    int      child;    /**< First callee, 0 if none */
+    int      sibling;  /**< Next callee of the parent, 0 if none */
+    uint64_t samples;  /**< Samples in exactly this call stack */
+} vmProfileNode_t;
+
+/** State of VM_Profile. Allocated in one block with the arrays. */
+typedef struct vmProfiler_s
+{
+    vmProfile_t results; /**< Counters for VM_GetProfile */
+
+    /** Code image with OP_PROFILE instead of every op code, same layout as
+     * vm->threadedCode (or vm->codeBase without direct threading) */
+    void* code;
+    int*  functionOf; /**< Function index for every int of vm->codeBase */
+    int*  active;     /**< Open calls of every function on the stack */
+    int   depth;      /**< Number of open calls */
+    int   lastOpcode; /**< Previous op code, -1 at the start of a call */
+    int   countdown;  /**< Instructions to the next sample, 0: no samples */
+    int   numNodes;   /**< Used entries in nodes */
+    vmProfileNode_t* nodes; /**< Call tree of the samples */
+    struct
+    {
+        int      function; /**< Function index of the call */
+        uint64_t start;    /**< results.instructions at OP_ENTER */
+    } stack[VM_PROFILE_MAX_DEPTH]; /**< Open calls */
+} vmProfiler_t;
+
+/** State of VM_SetBudget and of the suspended call. Allocated in one block
+ * with the arrays. */
+typedef struct vmBudget_s
+{
+    /** Code image with OP_BUDGET instead of the op code of every budget
+     * point, same layout as vm->threadedCode (or vm->codeBase without direct
+     * threading) */
+    void*    code;
+    uint8_t* point; /**< Budget point flag for every int of vm->codeBase */
+    int      limit; /**< Budget points per call, 0: no limit */
+    int      left;  /**< Budget points until the call is suspended */
+    int      armed; /**< Check the budget in the next interpreter call? */
+
+    /* interpreter state of the suspended call */
+    int programCounter; /**< Budget point that suspended the call */
+    int programStack;   /**< Program stack of the suspended call */
+    int opStackOfs;     /**< Op stack index of the suspended call */
+    int opStack[OPSTACK_SIZE / sizeof(int)]; /**< Op stack incl. the top */
+} vmBudget_t;
+
+#ifdef USE_JIT_X64
+/** Runtime state shared between VM_CallCompiled and the generated code.
+ * The native code keeps a pointer to this struct in r13. */
+typedef struct
+{
+    vm_t*    vm;           /**< VM that is executed */
+    uint8_t* dataBase;     /**< Copy of vm->dataBase, held in r12 */
+    int*     opStack;      /**< Op stack base, held in r14 */
+    intptr_t savedStack;   /**< Host stack pointer on entry */
+    intptr_t stackLimit;   /**< Calls below this host stack pointer fail */
+    intptr_t entry;        /**< Native address of the called function */
+    int      programStack; /**< Program stack, held in r15d */
+    int      opStackOfs;   /**< Op stack index, held in bl */
+    int      error;        /**< vmErrorCode_t if the code was aborted */
+} vmJitContext_t;
+
+/** Code generator state for VM_Compile. The code is generated twice: the
+ * first pass (buf == NULL) only measures the size and the location of every
+ * instruction, the second pass writes the machine code. */
+typedef struct
+{
+    uint8_t* buf;        /**< Output buffer, NULL in the first pass */
+    int      ofs;        /**< Current write offset */
+    int*     nativeOfs;  /**< Native offset for every int in vm->codeBase */
+    intptr_t* table;     /**< Native address for every instruction */
+    int      epilogue;   /**< Offset: store state and return to C */
+    int      error;      /**< Offset: abort with error code in esi */
+    int      errorPc;    /**< Offset: abort with VM_PC_OUT_OF_RANGE */
+    int      errorStack; /**< Offset: abort with VM_STACK_OVERFLOW */
+    int      errorOp;    /**< Offset: abort with VM_BAD_INSTRUCTION */
+    int      errorData;  /**< Offset: abort with VM_DATA_OUT_OF_RANGE */
+    int      callStub;   /**< Offset: OP_CALL to target in eax */
+    int      sysCall;    /**< Offset: OP_CALL of a syscall */
+    int      jumpStub;   /**< Offset: OP_JUMP to target in eax */
+} vmJit_t;
 #endif
 
 /******************************************************************************
@@ -248,9 +531,39 @@ typedef enum {
 
 static int vm_debugLevel; /**< 0: be quiet, 1: debug msgs, 2: print op codes */
 
-#ifdef DEBUG_VM
+#ifdef USE_CODE_CACHE
+static vmCodeImage_t* vm_codeCache;     /**< Images used by at least one VM */
+static volatile int   vm_codeCacheLock; /**< Spin lock for vm_codeCache */
+#endif
+
+#ifdef USE_ALLOC_POOL
+/** Free buffers of pooled VMs, by type and size class */
+static vmPoolBlock_t* vm_pool[VM_ALLOC_TYPE_MAX][VM_POOL_CLASSES];
+/** Number of buffers in the lists of vm_pool */
+static int          vm_poolCount[VM_ALLOC_TYPE_MAX][VM_POOL_CLASSES];
+static volatile int vm_poolLock; /**< Spin lock for vm_pool */
+#endif
+
+#ifdef USE_DIRECT_THREADING
+/** Address of the OP_PROFILE handler, set with vm->threadedCode */
+static intptr_t vm_profileHandler;
+/** Address of the OP_BUDGET handler, set with vm->threadedCode */
+static intptr_t vm_budgetHandler;
+#endif
+
+#ifdef USE_GUARD_PAGES
+/** Where VM_Run continues after a fault in the data segment of vm_guardVm.
+ * NULL while the thread runs host code. */
+static __thread sigjmp_buf* vm_guardJump;
+static __thread const vm_t* vm_guardVm; /**< VM run by VM_Run */
+static struct sigaction vm_guardOldSegv; /**< SIGSEGV handler of the host */
+static struct sigaction vm_guardOldBus;  /**< SIGBUS handler of the host */
+static volatile int     vm_guardLock;    /**< Spin lock to install handler */
+static int              vm_guardInstalled; /**< VM_GuardHandler installed? */
+#endif
+
 /** Table to convert op codes to readable names */
-const static char* opnames[OPCODE_TABLE_SIZE] = {
+static const char* opnames[OPCODE_TABLE_SIZE] = {
     "OP_UNDEF",  "OP_IGNORE", "OP_BREAK",  "OP_ENTER", "OP_LEAVE",
     "OP_CALL",   "OP_PUSH",   "OP_POP",    "OP_CONST", "OP_LOCAL",
     "OP_JUMP",   "OP_EQ",     "OP_NE",     "OP_LTI",   "OP_LEI",
@@ -263,7 +576,20 @@ const static char* opnames[OPCODE_TABLE_SIZE] = {
     "OP_MULU",   "OP_BAND",   "OP_BOR",    "OP_BXOR",  "OP_BCOM",
     "OP_LSH",    "OP_RSHI",   "OP_RSHU",   "OP_NEGF",  "OP_ADDF",
     "OP_SUBF",   "OP_DIVF",   "OP_MULF",   "OP_CVIF",  "OP_CVFI",
-    "OP_UNDEF",  "OP_UNDEF",  "OP_UNDEF",  "OP_UNDEF",
+    "OP_LOCAL_LOAD4", "OP_LOCAL_CONST_STORE4", "OP_CONST_ADD",
+    "OP_CONST_JUMP",  "OP_CONST_EQ",  "OP_CONST_NE",  "OP_CONST_LTI",
+    "OP_CONST_LEI",   "OP_CONST_GTI", "OP_CONST_GEI", "OP_CONST_LTU",
+    "OP_CONST_LEU",   "OP_CONST_GTU", "OP_CONST_GEU", "OP_CONST_CALL",
+    /* the remaining entries are NULL, these op codes are never valid */
+};
+
+#ifdef USE_JIT_X64
+/** Table to convert superinstructions back to the first op code of the
+ * original sequence (the JIT compiles the original sequence). */
+static const uint8_t fusedBaseOp[OP_FUSED_MAX - OP_MAX] = {
+    OP_LOCAL, OP_LOCAL, OP_CONST, OP_CONST, OP_CONST, OP_CONST, OP_CONST,
+    OP_CONST, OP_CONST, OP_CONST, OP_CONST, OP_CONST, OP_CONST, OP_CONST,
+    OP_CONST,
 };
 #endif
 
@@ -272,26 +598,225 @@ const static char* opnames[OPCODE_TABLE_SIZE] = {
  ******************************************************************************/
 
 /** Helper function for VM_Create: Set up the virtual machine during loading.
- * Copy the data from the file input (bytecode) to the vm.
- * @param[in,out] vm Pointer to virtual machine, prepared by VM_Create.
+ * Copy the data from the file input (bytecode) to the vm. The bytecode is
+ * only read, so it can be a read-only mapping of the .qvm file.
+ * @param[in,out] vm Pointer to virtual machine, prepared by VM_Create, with
+ *                   vm->stackSize and vm->heapLength.
  * @param[in] bytecode Pointer to bytecode.
  * @param[in] length Number of bytes in bytecode array.
- * @return Pointer to start/header of vm bytecode. */
-static const vmHeader_t* VM_LoadQVM(vm_t* vm, const uint8_t* bytecode,
-                                    int length);
+ * @param[in] options Limits of the bytecode, all fields set.
+ * @param[out] header Header of the bytecode in host byte order.
+ * @return 0 if everything is OK. -1 otherwise. */
+static int VM_LoadQVM(vm_t* vm, const uint8_t* bytecode, int length,
+                      const vmCreateOptions_t* options, vmHeader_t* header);
 
 /** Helper function for VM_Create: Set up the virtual machine during loading.
  * Ensure consistency and prepare the jumps.
  * @param[in,out] vm Pointer to virtual machine, prepared by VM_Create.
- * @param[in] header Header of .qvm bytecode.
+ * @param[in] header Header of .qvm bytecode in host byte order.
+ * @param[in] bytecode Pointer to bytecode.
  * @return 0 if everything is OK. -1 otherwise. */
-static int VM_PrepareInterpreter(vm_t* vm, const vmHeader_t* header);
+static int VM_PrepareInterpreter(vm_t* vm, const vmHeader_t* header,
+                                 const uint8_t* bytecode);
+
+/** Helper function for VM_PrepareInterpreter: peephole pass that replaces
+ * frequent op code sequences with superinstructions. Counts the replacements
+ * in vm->fusionCount.
+ * @param[in,out] vm Pointer to virtual machine with expanded code image. */
+static void VM_FuseInstructions(vm_t* vm);
+
+/** Helper function for VM_PrepareInterpreter: static verification of the
+ * expanded code image, before the jump targets are translated.
+ * Proves that the op stack depth of every instruction is the same on all
+ * paths and never under- or overflows, that OP_LEAVE matches the frame size
+ * of the OP_ENTER of the function, that branches stay in their function and
+ * that constant OP_CALL targets are the start of a function.
+ * @param[in] vm Pointer to virtual machine with expanded code image.
+ * @return 1 if the code is verified, 0 if the runtime checks are needed. */
+static int VM_VerifyCode(const vm_t* vm);
 
 /** Run a function from the virtual machine with the interpreter (i.e. no JIT).
+ * With USE_DIRECT_THREADING, a call with count == 0 only fills
+ * vm->threadedCode (the handler addresses are only known in this function).
+ * @param[in] vm Pointer to initialized virtual machine.
+ * @param[in] function Instruction number of the called function, 0: vmMain.
+ * @param[in] argc Number of arguments per call (0 to MAX_VMMAIN_ARGS).
+ * @param[in] args Arguments for function call, count * argc ints.
+ * @param[in] count Number of calls. All calls run in this one activation.
+ * @param[out] results Return value of every call, can be NULL.
+ * @return Return value of the (last) function call. */
+static int VM_CallInterpreted(vm_t* vm, int function, int argc,
+                              const int* args, int count, intptr_t* results);
+
+/** Call a native function of the host (negative OP_CALL target). The
+ * syscall number is expected at programStack + 4, followed by the arguments.
+ * @param[in,out] vm Current VM
+ * @param[in] programStack Program stack of the calling bytecode.
+ * @return Return value of the host function. */
+static intptr_t VM_SystemCall(vm_t* vm, int programStack);
+
+/** Count an instruction for VM_Profile, called by OP_PROFILE.
+ * @param[in,out] vm Current VM, with vm->profiler.
+ * @param[in] opcode Op code of the instruction.
+ * @param[in] programCounter Position of the op code in vm->codeBase.
+ * @param[in] programStack Program stack of the instruction. */
+static void VM_ProfileInstruction(vm_t* vm, int opcode, int programCounter,
+                                  int programStack);
+
+/** Helper function for VM_ProfileInstruction: add the call stack to the
+ * samples. Walks the stack frames up to the start of the VM call: the
+ * return address of a function is saved right above its frame, the frame
+ * size is the operand of its OP_ENTER.
+ * @param[in,out] vm Current VM, with vm->profiler.
+ * @param[in] programCounter Position of an op code in vm->codeBase, not of
+ *                           an OP_ENTER.
+ * @param[in] programStack Program stack of the instruction. */
+static void VM_ProfileSample(vm_t* vm, int programCounter, int programStack);
+
+/** Helper function for VM_GetFoldedStacks: append the name of a function
+ * and a separator like snprintf at buffer + length.
+ * @param[out] buffer Output of VM_GetFoldedStacks.
+ * @param[in] size Number of bytes in buffer.
+ * @param[in] length Length of the output so far, can be larger than size.
+ * @param[in] f Function to append.
+ * @param[in] separator Character after the name.
+ * @return Number of characters of the name and the separator. */
+static int VM_AppendFoldedName(char* buffer, int size, int length,
+                               const vmProfileFunction_t* f, char separator);
+
+/** Helper function for VM_OpcodeProfile_f: print an op code name and a
+ * comma, the number if the op code has no name.
+ * @param[in] opcode Op code to print. */
+static void VM_PrintOpcodeName(int opcode);
+
+/** Run a built-in syscall without calling the host.
+ * @param[in,out] vm Current VM
+ * @param[in] intrinsic Function to run, not VM_INTRINSIC_NONE.
+ * @param[in] args Arguments of the syscall (without the syscall number).
+ * @return Return value of the function. */
+static int VM_CallIntrinsic(vm_t* vm, vmIntrinsic_t intrinsic,
+                            const int* args);
+
+#ifdef USE_JIT_X64
+/** Helper function for VM_Create: translate the prepared code in
+ * vm->codeBase to native x86-64 code.
+ * @param[in,out] vm Pointer to virtual machine, prepared by VM_Create.
+ * @return 0 if everything is OK. -1 otherwise (use the interpreter). */
+static int VM_Compile(vm_t* vm);
+
+/** Run a function from the virtual machine with the native code.
  * @param[in] vm Pointer to initialized virtual machine.
- * @param[in] args Arguments for function call.
- * @return Return value of the function call. */
-static int VM_CallInterpreted(vm_t* vm, int* args);
+ * @param[in] function Instruction number of the called function, 0: vmMain.
+ * @param[in] argc Number of arguments per call (0 to MAX_VMMAIN_ARGS).
+ * @param[in] args Arguments for function call, count * argc ints.
+ * @param[in] count Number of calls.
+ * @param[out] results Return value of every call, can be NULL.
+ * @return Return value of the (last) function call. */
+static int VM_CallCompiled(vm_t* vm, int function, int argc, const int* args,
+                           int count, intptr_t* results);
+#endif
+
+#if defined(USE_COW_INSTANCES) || defined(USE_GUARD_PAGES)
+/** Number of bytes of a data segment mapping: dataAlloc in full pages */
+static size_t VM_DataMapLength(const vm_t* vm);
+#endif
+
+#ifdef USE_COW_INSTANCES
+
+/** Write a data segment to a new memory file, zero filled up to the mapping
+ * length of the vm.
+ * @param[in] vm Pointer to virtual machine.
+ * @param[in] data Content of the data segment.
+ * @param[in] length Number of bytes in data.
+ * @return File descriptor, -1 if the file could not be created. */
+static int VM_CreateDataFile(const vm_t* vm, const uint8_t* data, int length);
+
+/** Replace the data segment of the vm by a private (copy-on-write) mapping
+ * of a file created by VM_CreateDataFile.
+ * @param[in,out] vm Pointer to virtual machine.
+ * @param[in] fd File with the new data segment.
+ * @return 0 if everything is OK. -1 if the mapping failed. */
+static int VM_MapData(vm_t* vm, int fd);
+#endif
+
+#ifdef USE_CODE_CACHE
+/** FNV-1a hash of a code segment for the code cache.
+ * @param[in] code Code segment.
+ * @param[in] length Number of bytes in code.
+ * @return Hash value. */
+static uint32_t VM_HashCode(const uint8_t* code, int length);
+
+/** Look up the prepared code for a code segment in the code cache and use it
+ * for the vm. vm->codeLength, instructionCount and dataLength must be set.
+ * @param[in,out] vm Pointer to virtual machine.
+ * @param[in] code Code segment of the bytecode.
+ * @param[in] hash VM_HashCode of the code segment.
+ * @return 0 if the code was found. -1 if it has to be prepared. */
+static int VM_FindCodeImage(vm_t* vm, const uint8_t* code, uint32_t hash);
+
+/** Add the prepared code of the vm to the code cache. If this fails, the vm
+ * keeps its own code.
+ * @param[in,out] vm Pointer to virtual machine with prepared code.
+ * @param[in] code Code segment of the bytecode.
+ * @param[in] hash VM_HashCode of the code segment. */
+static void VM_AddCodeImage(vm_t* vm, const uint8_t* code, uint32_t hash);
+
+/** Drop the reference of the vm to its cached code. The code pointers of the
+ * vm are set to NULL, unless this was the last user of the image. Then VM_Free
+ * releases them.
+ * @param[in,out] vm Pointer to virtual machine with vm->codeImage. */
+static void VM_ReleaseCodeImage(vm_t* vm);
+#endif
+
+/** Allocate a code or data buffer of a vm. Like Com_malloc, but a pooled
+ * VM (vm->pooled) gets a buffer from the pool if there is one.
+ * @param[in] size Number of bytes to allocate.
+ * @param[in] vm Pointer to vm requesting the memory.
+ * @param[in] type What purpose has the requested memory.
+ * @return Pointer to the buffer, NULL if out of memory. */
+static void* VM_PoolAlloc(size_t size, vm_t* vm, vmMallocType_t type);
+
+/** Release a buffer of VM_PoolAlloc. A buffer of a pooled VM is kept in the
+ * pool for the next VM_PoolAlloc of the same type and size class.
+ * @param[in] p Buffer from VM_PoolAlloc with the same vm->pooled.
+ * @param[in] vm Pointer to vm releasing the memory.
+ * @param[in] type Type passed to VM_PoolAlloc. */
+static void VM_PoolFree(void* p, vm_t* vm, vmMallocType_t type);
+
+#ifdef USE_ALLOC_POOL
+/** Helper function for VM_PoolAlloc: find the size class of a buffer.
+ * @param[in] size Number of bytes requested.
+ * @param[out] classSize Number of bytes of every buffer of the class.
+ * @return Index of the size class, -1 if the buffer is too large. */
+static int VM_PoolSizeClass(size_t size, size_t* classSize);
+#endif
+
+/** Allocate the zero filled data segment of a vm: vm->dataAlloc bytes with
+ * VM_PoolAlloc, or the reservation with the guard pages.
+ * @param[in,out] vm Pointer to virtual machine, vm->dataBase is set.
+ * @return 0 if everything is OK. -1 if out of memory. */
+static int VM_AllocData(vm_t* vm);
+
+/** Release the data segment of a vm (allocated or mapped).
+ * @param[in,out] vm Pointer to virtual machine. */
+static void VM_FreeData(vm_t* vm);
+
+/** Run a function with the JIT or the interpreter. With guard pages, a fault
+ * in the data segment aborts the call with VM_DATA_OUT_OF_RANGE.
+ * Same arguments as VM_CallInterpreted.
+ * @return Return value of the (last) function call, -1 after a fault. */
+static intptr_t VM_Run(vm_t* vm, int function, int argc, const int* args,
+                       int count, intptr_t* results);
+
+#ifdef USE_GUARD_PAGES
+/** SIGSEGV and SIGBUS handler: jump back to VM_Run if the fault is in the
+ * guard pages of the running vm. Other faults are passed on to the handler
+ * of the host, the default action terminates the process.
+ * @param[in] sig Signal number.
+ * @param[in] info Fault address.
+ * @param[in] context Passed on to the handler of the host. */
+static void VM_GuardHandler(int sig, siginfo_t* info, void* context);
+#endif
 
 /** Executes a block copy operation (memcpy) within currentVM data space.
  * @param[out] dest Pointer (in VM space).
@@ -317,25 +842,50 @@ extern float _vmf(intptr_t x);
  * @param[in] destsize Number of free bytes in dest. */
 static void Q_strncpyz(char* dest, const char* src, int destsize);
 
+#define MAX_TOKEN_CHARS 1024 /**< max length of an individual token */
+
+/** Free the symbols of VM_LoadMap.
+ * @param[in,out] vm Pointer to virtual machine. */
+static void VM_FreeSymbols(vm_t* vm);
+
+/** qsort callback to sort vm->symbolTable by value */
+static int VM_SymbolSort(const void* a, const void* b);
+
+/** Find the symbol at or before a code offset with a binary search in
+ * vm->symbolTable (of the module, if vm is an instance).
+ * @param[in] vm Pointer to virtual machine.
+ * @param[in] value Code offset.
+ * @return Symbol with the largest value <= value (the first symbol if there
+ *         is none), NULL if there are no symbols. */
+static vmSymbol_t* VM_FindSymbol(const vm_t* vm, int value);
+
+/** Parse a hexadecimal number without 0x prefix, helper for VM_LoadMap.
+ * @param[in] text Zero terminated number.
+ * @return Value of the number. */
+static int ParseHex(const char* text);
+
+/** Read the next token of a text, helper for VM_LoadMap.
+ * @param[in,out] data_p Current read position, NULL at the end of the text.
+ * @param[out] com_token Buffer with MAX_TOKEN_CHARS bytes for the token.
+ * @return com_token, an empty string at the end of the text. */
+static char* COM_Parse(char** data_p, char* com_token);
+
 /******************************************************************************
  * DEBUG FUNCTIONS (only used if DEBUG_VM is defined)
  ******************************************************************************/
 
 #ifdef DEBUG_VM
-#include <stdio.h>           /* fopen to read symbols */
-#include <stdlib.h>          /* qsort */
-#define MAX_TOKEN_CHARS 1024 /**< max length of an individual token */
-/* WARNING: DEBUG_VM is not thread safe */
-static char com_token[MAX_TOKEN_CHARS]; /**< helper for COM_Parse */
-static int  com_lines;                  /**< helper for COM_Parse */
-static int  com_tokenline;              /**< helper for COM_Parse */
-static int ParseHex(const char* text);  /**< helper for VM_LoadSymbols */
+#include <stdio.h> /* fopen to read symbols */
+/* WARNING: the profile counters of the symbols are shared by all instances
+ * of a module and are not synchronized between threads */
 static void COM_StripExtension(const char* in,
                                char* out); /**< helper for VM_LoadSymbols */
 static char* VM_Indent(vm_t* vm);
 /** For profiling, find the symbol behind this value */
 static vmSymbol_t* VM_ValueToFunctionSymbol(vm_t* vm, int value);
-static const char* VM_ValueToSymbol(vm_t* vm, int value);
+/** Name of the symbol behind this value, text is used for "symbol+offset" */
+static const char* VM_ValueToSymbol(vm_t* vm, int value, char* text,
+                                    size_t textSize);
 /** Load a .map file for the virtual machine. The .map file
  * should have the same path as the .qvm file. */
 static void VM_LoadSymbols(vm_t* vm);
@@ -357,6 +907,15 @@ static void VM_StackTrace(vm_t* vm, int programCounter, int programStack);
 #define PADP(base, alignment) ((void*)PAD((intptr_t)(base), (alignment)))
 #define Q_ftol(v) ((long)(v))
 
+/** Index of a VM address in the data segment: masked, or as 32-bit unsigned
+ * with guard pages (an address out of range faults in the guard pages) or
+ * with the bounds check (the address is already checked) */
+#if defined(USE_GUARD_PAGES) || defined(USE_BOUNDS_CHECK)
+#define VM_DATA_INDEX(addr, mask) ((void)(mask), (uint32_t)(addr))
+#else
+#define VM_DATA_INDEX(addr, mask) ((addr) & (mask))
+#endif
+
 /******************************************************************************
  * FUNCTION BODIES
  ******************************************************************************/
@@ -364,6 +923,21 @@ static void VM_StackTrace(vm_t* vm, int programCounter, int programStack);
 int VM_Create(vm_t* vm, const char* name, const uint8_t* bytecode, int length,
               intptr_t (*systemCalls)(vm_t*, intptr_t*))
 {
+    return VM_CreateWithOptions(vm, name, bytecode, length, systemCalls, NULL);
+}
+
+int VM_CreateWithOptions(vm_t* vm, const char* name, const uint8_t* bytecode,
+                         int length, intptr_t (*systemCalls)(vm_t*, intptr_t*),
+                         const vmCreateOptions_t* options)
+{
+    vmCreateOptions_t limits = { VM_PROGRAM_STACK_SIZE, 0, VM_MAX_IMAGE_SIZE,
+                                 VM_MAX_BSS_LENGTH, 0 };
+    vmHeader_t        header;
+#ifdef USE_CODE_CACHE
+    const uint8_t*    code;
+    uint32_t          hash;
+#endif
+
     if (vm == NULL)
     {
         Com_Error(VM_INVALID_POINTER, "Invalid vm pointer");
@@ -376,10 +950,38 @@ int VM_Create(vm_t* vm, const char* name, const uint8_t* bytecode, int length,
         return -1;
     }
 
+    if (options)
+    {
+        if (options->stackSize < 0 || options->heapSize < 0 ||
+            options->maxImageSize < 0 || options->maxBssLength < 0 ||
+            options->maxImageSize > VM_MAX_DATA_LENGTH ||
+            (options->stackSize > 0 && options->stackSize < 256) ||
+            options->stackSize > VM_MAX_DATA_LENGTH / 4 ||
+            options->heapSize > VM_MAX_DATA_LENGTH / 2 ||
+            options->maxBssLength > VM_MAX_DATA_LENGTH / 4)
+        {
+            vm->lastError = VM_INVALID_OPTIONS;
+            Com_Error(vm->lastError, "Invalid vm options");
+            return -1;
+        }
+        /* 0: keep the default */
+        limits.stackSize    = options->stackSize ? options->stackSize
+                                                 : limits.stackSize;
+        limits.heapSize     = options->heapSize;
+        limits.maxImageSize = options->maxImageSize ? options->maxImageSize
+                                                    : limits.maxImageSize;
+        limits.maxBssLength = options->maxBssLength ? options->maxBssLength
+                                                    : limits.maxBssLength;
+        limits.pooled       = (options->pooled != 0);
+    }
+
     Com_Memset(vm, 0, sizeof(vm_t));
     Q_strncpyz(vm->name, name, sizeof(vm->name));
-    const vmHeader_t* header = VM_LoadQVM(vm, bytecode, length);
-    if (!header)
+    vm->pooled = limits.pooled; /* before the first VM_PoolAlloc */
+    /* the stack frames are int aligned, the heap for 16 byte types */
+    vm->stackSize  = PAD(limits.stackSize, (int)sizeof(int));
+    vm->heapLength = PAD(limits.heapSize, 16);
+    if (VM_LoadQVM(vm, bytecode, length, &limits, &header) != 0)
     {
         vm->lastError = VM_FAILED_TO_LOAD_BYTECODE;
         Com_Error(vm->lastError, "Failed to load bytecode");
@@ -387,33 +989,48 @@ int VM_Create(vm_t* vm, const char* name, const uint8_t* bytecode, int length,
         return -1;
     }
 
-    vm->systemCall = systemCalls;
+    vm->systemCall       = systemCalls;
+    vm->instructionCount = header.instructionCount;
+    vm->codeLength       = header.codeLength;
 
-    /* allocate space for the jump targets, which will be filled in by the
-       compile/prep functions */
-    vm->instructionCount    = header->instructionCount;
-    vm->instructionPointers = (intptr_t*)Com_malloc(
-        vm->instructionCount * sizeof(*vm->instructionPointers), vm,
-        VM_ALLOC_INSTRUCTION_POINTERS);
-    if (!vm->instructionPointers)
+    /* the stack is implicitly at the end of the image */
+    vm->programStack = vm->dataLength;
+    vm->stackBottom  = vm->programStack - vm->stackSize;
+    vm->heapTop      = vm->heapBase;
+
+#ifdef USE_CODE_CACHE
+    code = bytecode + header.codeOffset;
+    hash = VM_HashCode(code, header.codeLength);
+    if (VM_FindCodeImage(vm, code, hash) != 0)
+#endif
     {
-        vm->lastError = VM_MALLOC_FAILED;
-        Com_Error(vm->lastError,
-                  "Instr. pointer malloc failed: out of memory?");
-        VM_Free(vm);
-        return -1;
-    }
-
-    vm->codeLength = header->codeLength;
+        /* allocate space for the jump targets, which will be filled in by the
+           compile/prep functions */
+        vm->instructionPointers = (intptr_t*)VM_PoolAlloc(
+            vm->instructionCount * sizeof(*vm->instructionPointers), vm,
+            VM_ALLOC_INSTRUCTION_POINTERS);
+        if (!vm->instructionPointers)
+        {
+            vm->lastError = VM_MALLOC_FAILED;
+            Com_Error(vm->lastError,
+                      "Instr. pointer malloc failed: out of memory?");
+            VM_Free(vm);
+            return -1;
+        }
 
-    vm->compiled = 0; /* no JIT */
-    if (!vm->compiled)
-    {
-        if (VM_PrepareInterpreter(vm, header) != 0)
+        if (VM_PrepareInterpreter(vm, &header, bytecode) != 0)
         {
             VM_Free(vm);
             return -1;
         }
+
+#ifdef USE_JIT_X64
+        /* the interpreter is the fallback if the code can't be compiled */
+        vm->compiled = (VM_Compile(vm) == 0);
+#endif
+#ifdef USE_CODE_CACHE
+        VM_AddCodeImage(vm, code, hash);
+#endif
     }
 
 #ifdef DEBUG_VM
@@ -421,115 +1038,257 @@ int VM_Create(vm_t* vm, const char* name, const uint8_t* bytecode, int length,
     VM_LoadSymbols(vm);
 #endif
 
-    /* the stack is implicitly at the end of the image */
-    vm->programStack = vm->dataMask + 1;
-    vm->stackBottom  = vm->programStack - VM_PROGRAM_STACK_SIZE;
-
 #ifdef DEBUG_VM
     Com_Printf("VM:\n");
-    Com_Printf(".code length: %6i bytes\n", header->codeLength);
-    Com_Printf(".data length: %6i bytes\n", header->dataLength);
-    Com_Printf(".lit  length: %6i bytes\n", header->litLength);
-    Com_Printf(".bss  length: %6i bytes\n", header->bssLength);
-    Com_Printf("Stack size:   %6i bytes\n", VM_PROGRAM_STACK_SIZE);
+    Com_Printf(".code length: %6i bytes\n", header.codeLength);
+    Com_Printf(".data length: %6i bytes\n", header.dataLength);
+    Com_Printf(".lit  length: %6i bytes\n", header.litLength);
+    Com_Printf(".bss  length: %6i bytes\n", header.bssLength);
+    Com_Printf("Stack size:   %6i bytes\n", vm->stackSize);
+    Com_Printf("Heap size:    %6i bytes\n", vm->heapLength);
     Com_Printf("Allocated memory: %6i bytes\n", vm->dataAlloc);
-    Com_Printf("Instruction count: %i\n", header->instructionCount);
+    Com_Printf("Instruction count: %i\n", header.instructionCount);
+    Com_Printf("Superinstructions: %i\n", vm->fusionCount);
 #endif
 
     return 0;
 }
 
-static const vmHeader_t* VM_LoadQVM(vm_t* vm, const uint8_t* bytecode,
-                                    int length)
+int VM_CreateInstance(vm_t* vm, const vm_t* module)
 {
-    int dataLength;
-    int i;
-    const union {
-        const vmHeader_t* h;
-        const uint8_t*    v;
-    } header = {.v = bytecode };
+    if (vm == NULL || module == NULL || vm == module)
+    {
+        Com_Error(VM_INVALID_POINTER, "Invalid vm pointer");
+        return -1;
+    }
+    if (module->module)
+    {
+        module = module->module; /* instance of an instance */
+    }
+    Com_Memset(vm, 0, sizeof(vm_t));
+    if (module->codeLength < 1 || !module->initData)
+    {
+        vm->lastError = VM_NOT_LOADED;
+        Com_Error(vm->lastError, "VM not loaded");
+        return -1;
+    }
+
+    /* only copy what is not changed by running the module */
+    Com_Memcpy(vm->name, module->name, sizeof(vm->name));
+    vm->module              = module;
+    vm->systemCall          = module->systemCall;
+    vm->systemCalls         = module->systemCalls;
+    vm->numSystemCalls      = module->numSystemCalls;
+    vm->compiled            = module->compiled;
+    vm->codeBase            = module->codeBase;
+    vm->codeLength          = module->codeLength;
+    vm->instructionPointers = module->instructionPointers;
+    vm->instructionCount    = module->instructionCount;
+    vm->fusionCount         = module->fusionCount;
+    vm->threadedCode        = module->threadedCode;
+    vm->verified            = module->verified;
+    vm->dataMask            = module->dataMask;
+    vm->dataAlloc           = module->dataAlloc;
+    vm->dataLength          = module->dataLength;
+    vm->stackBottom         = module->stackBottom;
+    vm->stackSize           = module->stackSize;
+    vm->heapBase            = module->heapBase;
+    vm->heapLength          = module->heapLength;
+    vm->heapTop             = module->heapBase; /* initial data: empty */
+    vm->pooled              = module->pooled;
+    vm->numSymbols          = module->numSymbols;
+    vm->symbols             = module->symbols;
+    vm->symbolTable         = module->symbolTable;
+    vm->jitCode             = module->jitCode;
+    vm->jitCodeLength       = module->jitCodeLength;
+    vm->initData            = module->initData;
+    vm->initDataLength      = module->initDataLength;
+
+#ifdef USE_COW_INSTANCES
+    /* private mapping: pages are shared until the instance writes */
+    if (module->initDataFd <= 0 || VM_MapData(vm, module->initDataFd) != 0)
+#endif
+    {
+        if (VM_AllocData(vm) != 0)
+        {
+            vm->lastError = VM_MALLOC_FAILED;
+            Com_Error(vm->lastError, "Data malloc failed: out of memory?");
+            Com_Memset(vm, 0, sizeof(vm_t));
+            return -1;
+        }
+        Com_Memcpy(vm->dataBase, vm->initData, vm->initDataLength);
+    }
+
+    /* the stack is implicitly at the end of the image */
+    vm->programStack = vm->dataLength;
+
+    return 0;
+}
+
+static int VM_LoadQVM(vm_t* vm, const uint8_t* bytecode, int length,
+                      const vmCreateOptions_t* options, vmHeader_t* header)
+{
+    int32_t fields[sizeof(vmHeader_t) / 4];
+    int64_t dataLength; /* 64 bit: the sum of the sections can overflow */
+    int     bssLength;
+    int     i;
 
     Com_Printf("Loading vm file %s...\n", vm->name);
 
-    if (!header.h || !bytecode || length <= (int)sizeof(vmHeader_t) ||
-        length > VM_MAX_IMAGE_SIZE)
+    if (!bytecode || length <= (int)sizeof(vmHeader_t) ||
+        length > options->maxImageSize)
     {
         Com_Printf("Failed.\n");
-        return NULL;
+        return -1;
     }
 
-    if (LittleLong(header.h->vmMagic) == VM_MAGIC)
+    /* byte swap a copy of the header, the bytecode might be read-only */
+    for (i = 0; i < (int)ARRAY_LEN(fields); i++)
     {
-        /* byte swap the header */
-        for (i = 0; i < (int)(sizeof(vmHeader_t)) / 4; i++)
-        {
-            ((int*)header.h)[i] = LittleLong(((int*)header.h)[i]);
-        }
+        fields[i] = LittleEndianToHost(&bytecode[i * 4]);
+    }
+    Com_Memcpy(header, fields, sizeof(*header));
 
+    if (header->vmMagic == VM_MAGIC)
+    {
         /* validate */
-        if (header.h->bssLength < 0 || header.h->dataLength < 0 ||
-            header.h->litLength < 0 || header.h->codeLength <= 0 ||
-            header.h->codeOffset < 0 || header.h->dataOffset < 0 ||
-            header.h->instructionCount <= 0 ||
-            header.h->bssLength > VM_MAX_BSS_LENGTH ||
-            header.h->codeOffset + header.h->codeLength > length ||
-            header.h->dataOffset + header.h->dataLength + header.h->litLength >
+        if (header->bssLength < 0 || header->dataLength < 0 ||
+            header->litLength < 0 || header->codeLength <= 0 ||
+            header->codeOffset < 0 || header->dataOffset < 0 ||
+            header->instructionCount <= 0 ||
+            header->bssLength > options->maxBssLength ||
+            (int64_t)header->codeOffset + header->codeLength > length ||
+            (int64_t)header->dataOffset + header->dataLength +
+                    header->litLength >
                 length)
         {
             Com_Printf("Warning: %s has bad header\n", vm->name);
-            return NULL;
+            return -1;
         }
     }
     else
     {
         Com_Printf("Warning: Invalid magic number in header of \"%s\". "
                    "Read: 0x%x, expected: 0x%x\n",
-                   vm->name, LittleLong(header.h->vmMagic), VM_MAGIC);
-        return NULL;
+                   vm->name, header->vmMagic, VM_MAGIC);
+        return -1;
     }
 
+    /* q3asm reserves the stack at the end of .bss: replace it with the heap
+       and the stack of the vm */
+    bssLength = header->bssLength;
+    if (bssLength >= VM_PROGRAM_STACK_SIZE)
+    {
+        bssLength -= VM_PROGRAM_STACK_SIZE;
+    }
+    dataLength = PAD((int64_t)header->dataLength + header->litLength + bssLength,
+                     16);
+    dataLength += (int64_t)vm->heapLength + vm->stackSize;
+    if (dataLength > VM_MAX_DATA_LENGTH)
+    {
+        Com_Printf("Warning: %s needs too much data memory\n", vm->name);
+        return -1;
+    }
+    vm->heapBase = (int)dataLength - vm->heapLength - vm->stackSize;
+#if defined(USE_GUARD_PAGES)
+    /* every access outside of the segment hits a guard page: allocate the
+       exact size (aligned for the stack), there is nothing to mask */
+    vm->dataLength = PAD((int)dataLength, (int)sizeof(int));
+    vm->dataAlloc  = vm->dataLength;
+    vm->dataMask   = -1;
+#elif defined(USE_BOUNDS_CHECK)
+    /* the exact size (aligned for the stack), only the first byte of an
+       access is checked: leave space for the rest of an int */
+    vm->dataLength = PAD((int)dataLength, (int)sizeof(int));
+    vm->dataAlloc  = vm->dataLength + 4;
+    vm->dataMask   = -1;
+#else
     /* round up to next power of 2 so all data operations can
        be mask protected */
-    dataLength =
-        header.h->dataLength + header.h->litLength + header.h->bssLength;
     for (i = 0; dataLength > (1 << i); i++)
     {
     }
-    dataLength = 1 << i;
 
-    /* allocate zero filled space for initialized and uninitialized data
-     leave some space beyond data mask so we can secure all mask operations */
-    vm->dataAlloc = dataLength + 4;
-    vm->dataBase  = (uint8_t*)Com_malloc(vm->dataAlloc, vm, VM_ALLOC_DATA_SEC);
-    vm->dataMask  = dataLength - 1;
-    if (vm->dataBase == NULL)
+    /* leave some space beyond data mask so we can secure all mask
+       operations */
+    vm->dataLength = 1 << i;
+    vm->dataAlloc  = vm->dataLength + 4;
+    vm->dataMask   = vm->dataLength - 1;
+#endif
+
+    /* allocate zero filled space for initialized and uninitialized data */
+    if (VM_AllocData(vm) != 0)
     {
         Com_Error(VM_MALLOC_FAILED, "Data malloc failed: out of memory?\n");
-        return NULL;
+        return -1;
     }
-    /* make sure data section is always initialized with 0
-     * (bss would be enough) */
-    Com_Memset(vm->dataBase, 0, vm->dataAlloc);
 
     /* copy the intialized data */
-    Com_Memcpy(vm->dataBase, header.v + header.h->dataOffset,
-               header.h->dataLength + header.h->litLength);
+    Com_Memcpy(vm->dataBase, bytecode + header->dataOffset,
+               header->dataLength + header->litLength);
 
     /* byte swap the longs */
-    for (i = 0; i < header.h->dataLength; i += sizeof(int))
+    for (i = 0; i < header->dataLength; i += sizeof(int))
     {
         *(int*)(vm->dataBase + i) = LittleLong(*(int*)(vm->dataBase + i));
     }
 
-    return header.h;
+    /* keep the initial data for VM_CreateInstance */
+    vm->initDataLength = header->dataLength + header->litLength;
+    vm->initData =
+        (uint8_t*)VM_PoolAlloc(vm->initDataLength + 1, vm, VM_ALLOC_DATA_SEC);
+    if (vm->initData == NULL)
+    {
+        Com_Error(VM_MALLOC_FAILED, "Data malloc failed: out of memory?\n");
+        return -1;
+    }
+    Com_Memcpy(vm->initData, vm->dataBase, vm->initDataLength);
+#ifdef USE_COW_INSTANCES
+    if (vm->dataAlloc >= VM_COW_MIN_LENGTH)
+    {
+        /* if this fails, the instances get a copy of initData */
+        i = VM_CreateDataFile(vm, vm->initData, vm->initDataLength);
+        vm->initDataFd = (i > 0) ? i : 0;
+    }
+#endif
+
+    return 0;
 }
 
 intptr_t VM_Call(vm_t* vm, int command, ...)
+{
+    int     args[MAX_VMMAIN_ARGS];
+    va_list ap;
+    int     i;
+
+    /* the number of arguments is unknown: always read all of them, use
+       VM_CallArgs or VM_Call0..VM_Call3 to pass only the required ones */
+    args[0] = command;
+    va_start(ap, command);
+    for (i = 1; i < (int)ARRAY_LEN(args); i++)
+    {
+        args[i] = va_arg(ap, int);
+    }
+    va_end(ap);
+
+    return VM_CallArgs(vm, MAX_VMMAIN_ARGS, args);
+}
+
+intptr_t VM_CallArgs(vm_t* vm, int argc, const int* argv)
+{
+    if (vm != NULL && argc < 1)
+    {
+        vm->lastError = VM_BAD_ARGUMENT_COUNT;
+        Com_Error(vm->lastError, "VM_CallArgs: invalid number of arguments");
+        return -1;
+    }
+    /* vmMain is the first function */
+    return VM_CallFunction(vm, 0, argc, argv);
+}
+
+intptr_t VM_CallFunction(vm_t* vm, int function, int argc, const int* argv)
 {
     intptr_t r;
-    int      args[MAX_VMMAIN_ARGS];
-    va_list  ap;
-    int      i;
 
     if (vm == NULL)
     {
@@ -542,148 +1301,1922 @@ intptr_t VM_Call(vm_t* vm, int command, ...)
         Com_Error(vm->lastError, "VM not loaded");
         return -1;
     }
-
-    /* FIXME this is not nice. we should check the actual number of arguments */
-    args[0] = command;
-    va_start(ap, command);
-    for (i = 1; i < (int)ARRAY_LEN(args); i++)
+    if (argc < 0 || argc > MAX_VMMAIN_ARGS || (argv == NULL && argc > 0))
     {
-        args[i] = va_arg(ap, int);
+        vm->lastError = VM_BAD_ARGUMENT_COUNT;
+        Com_Error(vm->lastError, "VM_Call: invalid number of arguments");
+        return -1;
+    }
+    if (function < 0 || function >= vm->instructionCount ||
+        ((const int*)vm->codeBase)[vm->instructionPointers[function]] !=
+            OP_ENTER)
+    {
+        /* only function entry points, not any instruction */
+        vm->lastError = VM_PC_OUT_OF_RANGE;
+        Com_Error(vm->lastError, "VM_CallFunction: invalid function");
+        return -1;
+    }
+    if (vm->suspended)
+    {
+        vm->lastError = VM_CALL_ON_SUSPENDED_VM;
+        Com_Error(vm->lastError, "VM_Call on suspended vm");
+        return -1;
     }
-    va_end(ap);
 
     ++vm->callLevel;
-    r = VM_CallInterpreted(vm, args);
-    --vm->callLevel;
+    if (vm->budget)
+    {
+        /* a call from a syscall can't be suspended */
+        vm->budget->armed = (vm->callLevel == 1 && vm->budget->limit > 0);
+    }
+    r = VM_Run(vm, function, argc, argv, 1, NULL);
+    if (!vm->suspended)
+    {
+        --vm->callLevel; /* a suspended call is still running */
+    }
 
     return r;
 }
 
-void VM_Free(vm_t* vm)
+intptr_t VM_Resume(vm_t* vm)
 {
-    if (!vm)
+    intptr_t r;
+
+    if (vm == NULL)
     {
-        return;
+        Com_Error(VM_INVALID_POINTER, "VM_Resume with NULL vm");
+        return -1;
     }
-    if (vm->callLevel)
+    if (!vm->suspended)
     {
-        vm->lastError = VM_FREE_ON_RUNNING_VM;
-        Com_Error(vm->lastError, "VM_Free on running vm");
-        return;
+        vm->lastError = VM_NOT_SUSPENDED;
+        Com_Error(vm->lastError, "VM_Resume without suspended call");
+        return -1;
     }
 
-    if (vm->codeBase)
+    /* vm->callLevel is still 1 */
+    vm->budget->armed = (vm->budget->limit > 0);
+    r                 = VM_Run(vm, 0, 0, NULL, 1, NULL);
+    if (!vm->suspended)
     {
-        Com_free(vm->codeBase, vm, VM_ALLOC_CODE_SEC);
-        vm->codeBase = NULL;
+        --vm->callLevel;
     }
 
-    if (vm->dataBase)
-    {
-        Com_free(vm->dataBase, vm, VM_ALLOC_DATA_SEC);
-        vm->dataBase = NULL;
-    }
+    return r;
+}
 
-    if (vm->instructionPointers)
+int VM_Abort(vm_t* vm)
+{
+    if (vm == NULL)
     {
-        Com_free(vm->instructionPointers, vm, VM_ALLOC_INSTRUCTION_POINTERS);
-        vm->instructionPointers = NULL;
+        Com_Error(VM_INVALID_POINTER, "VM_Abort with NULL vm");
+        return -1;
     }
-
-#ifdef DEBUG_VM
-    vmSymbol_t* sym = vm->symbols;
-    while (sym)
+    if (!vm->suspended)
     {
-        vmSymbol_t* next = sym->next;
-        Com_free(sym, NULL, VM_ALLOC_DEBUG);
-        sym = next;
+        vm->lastError = VM_NOT_SUSPENDED;
+        Com_Error(vm->lastError, "VM_Abort without suspended call");
+        return -1;
     }
-#endif
 
-    Com_Memset(vm, 0, sizeof(*vm));
+    /* vm->programStack is already back at the start of the call */
+    vm->suspended = 0;
+    --vm->callLevel;
+
+    return 0;
 }
 
-void* VM_ArgPtr(intptr_t vmAddr, vm_t* vm)
+int VM_CallBatch(vm_t* vm, int count, int argc, const int* argv,
+                 intptr_t* results)
 {
-    if (!vmAddr)
+    if (vm == NULL)
     {
-        return NULL;
+        Com_Error(VM_INVALID_POINTER, "VM_CallBatch with NULL vm");
+        return -1;
     }
-    if (vm == NULL)
+    if (vm->codeLength < 1)
     {
-        Com_Error(VM_INVALID_POINTER, "Invalid VM pointer");
-        return NULL;
+        vm->lastError = VM_NOT_LOADED;
+        Com_Error(vm->lastError, "VM not loaded");
+        return -1;
     }
-
+    if (argc < 1 || argc > MAX_VMMAIN_ARGS || argv == NULL || count < 0)
+    {
+        vm->lastError = VM_BAD_ARGUMENT_COUNT;
+        Com_Error(vm->lastError, "VM_CallBatch: invalid arguments");
+        return -1;
+    }
+    if (vm->suspended)
+    {
+        vm->lastError = VM_CALL_ON_SUSPENDED_VM;
+        Com_Error(vm->lastError, "VM_CallBatch on suspended vm");
+        return -1;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    vm->lastError = VM_NO_ERROR;
+    ++vm->callLevel;
+    VM_Run(vm, 0, argc, argv, count, results);
+    --vm->callLevel;
+
+    return (vm->lastError == VM_NO_ERROR) ? 0 : -1;
+}
+
+static intptr_t VM_Run(vm_t* vm, int function, int argc, const int* args,
+                       int count, intptr_t* results)
+{
+    intptr_t r;
+#ifdef USE_GUARD_PAGES
+    sigjmp_buf        jump;
+    sigjmp_buf* const outerJump    = vm_guardJump; /* recursive VM calls */
+    const vm_t* const outerVm      = vm_guardVm;
+    const int         programStack = vm->programStack;
+
+    /* the signal mask isn't saved: VM_GuardHandler runs with SA_NODEFER */
+    if (sigsetjmp(jump, 0))
+    {
+        vm_guardJump              = outerJump;
+        vm_guardVm                = outerVm;
+        vm->programStack          = programStack;
+        vm->currentlyInterpreting = 0;
+        vm->lastError             = VM_DATA_OUT_OF_RANGE;
+        Com_Error(vm->lastError, "Memory access out of range");
+        return -1;
+    }
+    vm_guardJump = &jump;
+    vm_guardVm   = vm;
+#endif
+
+#ifdef USE_JIT_X64
+    /* a suspended call or a call with a budget continues in the
+       interpreter, see VM_SetBudget */
+    if (vm->compiled && vm->jitCode && !vm->profiling && !vm->suspended &&
+        !(vm->budget && vm->budget->armed))
+    {
+        r = VM_CallCompiled(vm, function, argc, args, count, results);
+    }
+    else
+#endif
+    {
+        r = VM_CallInterpreted(vm, function, argc, args, count, results);
+    }
+
+#ifdef USE_GUARD_PAGES
+    vm_guardJump = outerJump;
+    vm_guardVm   = outerVm;
+#endif
+    return r;
+}
+
+intptr_t VM_Call0(vm_t* vm, int command)
+{
+    return VM_CallArgs(vm, 1, &command);
+}
+
+intptr_t VM_Call1(vm_t* vm, int command, int arg1)
+{
+    int args[2];
+    args[0] = command;
+    args[1] = arg1;
+    return VM_CallArgs(vm, 2, args);
+}
+
+intptr_t VM_Call2(vm_t* vm, int command, int arg1, int arg2)
+{
+    int args[3];
+    args[0] = command;
+    args[1] = arg1;
+    args[2] = arg2;
+    return VM_CallArgs(vm, 3, args);
+}
+
+intptr_t VM_Call3(vm_t* vm, int command, int arg1, int arg2, int arg3)
+{
+    int args[4];
+    args[0] = command;
+    args[1] = arg1;
+    args[2] = arg2;
+    args[3] = arg3;
+    return VM_CallArgs(vm, 4, args);
+}
+
+int VM_SetSystemCalls(vm_t* vm, const vmSystemCallEntry_t* table, int count)
+{
+    int i;
+
+    if (vm == NULL)
+    {
+        Com_Error(VM_INVALID_POINTER, "Invalid vm pointer");
+        return -1;
+    }
+    if (count < 0 || (table == NULL && count > 0))
+    {
+        vm->lastError = VM_BAD_ARGUMENT_COUNT;
+        Com_Error(vm->lastError, "VM_SetSystemCalls: invalid table");
+        return -1;
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (table[i].argc < 0 || table[i].argc >= MAX_VMSYSCALL_ARGS ||
+            (unsigned int)table[i].intrinsic >= VM_INTRINSIC_MAX)
+        {
+            vm->lastError = VM_BAD_ARGUMENT_COUNT;
+            Com_Error(vm->lastError, "VM_SetSystemCalls: invalid argc");
+            return -1;
+        }
+    }
+
+    vm->systemCalls    = table;
+    vm->numSystemCalls = count;
+
+    return 0;
+}
+
+int VM_LoadMap(vm_t* vm, const char* map)
+{
+    char *       text_p, *token;
+    char         com_token[MAX_TOKEN_CHARS];
+    vmSymbol_t **prev, *sym;
+    int          count;
+    int          value;
+    int          chars;
+    int          segment;
+
+    if (vm == NULL || vm->module || map == NULL)
+    {
+        Com_Error(VM_INVALID_POINTER, "Invalid vm pointer");
+        return -1;
+    }
+    if (vm->codeLength < 1)
+    {
+        vm->lastError = VM_NOT_LOADED;
+        Com_Error(vm->lastError, "VM not loaded");
+        return -1;
+    }
+
+    VM_FreeSymbols(vm);
+
+    /* parse the symbols: segment, value and name on every line */
+    text_p = (char*)map; /* COM_Parse doesn't write to the text */
+    prev   = &vm->symbols;
+    count  = 0;
+
+    while (1)
+    {
+        token = COM_Parse(&text_p, com_token);
+        if (!token[0])
+        {
+            break;
+        }
+        segment = ParseHex(token);
+        if (segment)
+        {
+            COM_Parse(&text_p, com_token);
+            COM_Parse(&text_p, com_token);
+            continue; /* only load code segment values */
+        }
+
+        token = COM_Parse(&text_p, com_token);
+        if (!token[0])
+        {
+            Com_Printf("WARNING: incomplete line at end of file\n");
+            break;
+        }
+        value = ParseHex(token);
+
+        token = COM_Parse(&text_p, com_token);
+        if (!token[0])
+        {
+            Com_Printf("WARNING: incomplete line at end of file\n");
+            break;
+        }
+        chars = strlen(token);
+        sym   = Com_malloc(sizeof(*sym) + chars, vm, VM_ALLOC_DEBUG);
+        *prev = sym;
+        if (!sym)
+        {
+            vm->lastError = VM_MALLOC_FAILED;
+            Com_Error(vm->lastError,
+                      "Sym. pointer malloc failed: out of memory?");
+            break;
+        }
+        Com_Memset(sym, 0, sizeof(*sym) + chars);
+        prev      = &sym->next;
+        sym->next = NULL;
+
+        /* convert value from an instruction number to a code offset */
+        if (value >= 0 && value < vm->instructionCount)
+        {
+            value = vm->instructionPointers[value];
+        }
+
+        sym->symValue = value;
+        Com_Memcpy(sym->symName, token, chars + 1);
+
+        count++;
+    }
+
+    vm->numSymbols = count;
+
+    /* sorted array for the lookup by value */
+    if (count > 0)
+    {
+        vm->symbolTable = (vmSymbol_t**)Com_malloc(
+            count * sizeof(*vm->symbolTable), vm, VM_ALLOC_DEBUG);
+        if (!vm->symbolTable)
+        {
+            vm->lastError = VM_MALLOC_FAILED;
+            Com_Error(vm->lastError,
+                      "Sym. table malloc failed: out of memory?");
+            return count;
+        }
+        count = 0;
+        for (sym = vm->symbols; sym; sym = sym->next)
+        {
+            vm->symbolTable[count++] = sym;
+        }
+        qsort(vm->symbolTable, count, sizeof(*vm->symbolTable),
+              VM_SymbolSort);
+    }
+
+    return count;
+}
+
+int VM_FindFunction(const vm_t* vm, const char* name)
+{
+    const vmSymbol_t* sym;
+    int               low, high, mid;
+
+    if (vm == NULL || name == NULL)
+    {
+        return -1;
+    }
+    if (vm->module)
+    {
+        vm = vm->module; /* the symbols belong to the module */
+    }
+
+    for (sym = vm->symbols; sym; sym = sym->next)
+    {
+        if (sym->symValue >= 0 && !strcmp(sym->symName, name))
+        {
+            break;
+        }
+    }
+    if (!sym)
+    {
+        return -1;
+    }
+
+    /* the symbol is a code offset, instructionPointers is sorted */
+    low  = 0;
+    high = vm->instructionCount - 1;
+    while (low <= high)
+    {
+        mid = low + (high - low) / 2;
+        if (vm->instructionPointers[mid] < sym->symValue)
+        {
+            low = mid + 1;
+        }
+        else if (vm->instructionPointers[mid] > sym->symValue)
+        {
+            high = mid - 1;
+        }
+        else if (((const int*)vm->codeBase)[sym->symValue] == OP_ENTER)
+        {
+            return mid;
+        }
+        else
+        {
+            break; /* a label, not a function */
+        }
+    }
+
+    return -1;
+}
+
+void VM_Free(vm_t* vm)
+{
+    if (!vm)
+    {
+        return;
+    }
+    if (vm->suspended)
+    {
+        VM_Abort(vm);
+    }
+    if (vm->callLevel)
+    {
+        vm->lastError = VM_FREE_ON_RUNNING_VM;
+        Com_Error(vm->lastError, "VM_Free on running vm");
+        return;
+    }
+
+    if (vm->profiler)
+    {
+        Com_free(vm->profiler, vm, VM_ALLOC_DEBUG);
+        vm->profiler = NULL;
+    }
+
+    if (vm->budget)
+    {
+        Com_free(vm->budget, vm, VM_ALLOC_CODE_SEC);
+        vm->budget = NULL;
+    }
+
+    if (vm->module)
+    {
+        /* instance: everything else belongs to the module */
+        VM_FreeData(vm);
+        Com_Memset(vm, 0, sizeof(*vm));
+        return;
+    }
+
+#ifdef USE_CODE_CACHE
+    if (vm->codeImage)
+    {
+        VM_ReleaseCodeImage(vm);
+    }
+#endif
+
+    if (vm->codeBase)
+    {
+        VM_PoolFree(vm->codeBase, vm, VM_ALLOC_CODE_SEC);
+        vm->codeBase = NULL;
+    }
+
+    if (vm->threadedCode)
+    {
+        VM_PoolFree(vm->threadedCode, vm, VM_ALLOC_CODE_SEC);
+        vm->threadedCode = NULL;
+    }
+
+    VM_FreeData(vm);
+
+    if (vm->initData)
+    {
+        VM_PoolFree(vm->initData, vm, VM_ALLOC_DATA_SEC);
+        vm->initData = NULL;
+    }
+
+#ifdef USE_COW_INSTANCES
+    if (vm->initDataFd > 0)
+    {
+        close(vm->initDataFd);
+        vm->initDataFd = 0;
+    }
+#endif
+
+    if (vm->instructionPointers)
+    {
+        VM_PoolFree(vm->instructionPointers, vm,
+                    VM_ALLOC_INSTRUCTION_POINTERS);
+        vm->instructionPointers = NULL;
+    }
+
+#ifdef USE_JIT_X64
+    if (vm->jitCode)
+    {
+        munmap(vm->jitCode, vm->jitCodeLength);
+        vm->jitCode = NULL;
+    }
+#endif
+
+    VM_FreeSymbols(vm);
+
+    Com_Memset(vm, 0, sizeof(*vm));
+}
+
+void VM_ReleasePool(void)
+{
+#ifdef USE_ALLOC_POOL
+    vmPoolBlock_t* block;
+    int            type;
+    int            sizeClass;
+
+    while (__sync_lock_test_and_set(&vm_poolLock, 1))
+    {
+    }
+    for (type = 0; type < VM_ALLOC_TYPE_MAX; type++)
+    {
+        for (sizeClass = 0; sizeClass < VM_POOL_CLASSES; sizeClass++)
+        {
+            while ((block = vm_pool[type][sizeClass]) != NULL)
+            {
+                vm_pool[type][sizeClass] = block->s.next;
+                Com_free(block, NULL, (vmMallocType_t)type);
+            }
+            vm_poolCount[type][sizeClass] = 0;
+        }
+    }
+    __sync_lock_release(&vm_poolLock);
+#endif
+}
+
+int VM_Snapshot(vm_t* vm, vmSnapshot_t* snapshot, int trackPages)
+{
+    if (vm == NULL || snapshot == NULL)
+    {
+        Com_Error(VM_INVALID_POINTER, "Invalid vm pointer");
+        return -1;
+    }
+    Com_Memset(snapshot, 0, sizeof(*snapshot));
+    if (vm->codeLength < 1 || !vm->dataBase)
+    {
+        vm->lastError = VM_NOT_LOADED;
+        Com_Error(vm->lastError, "VM not loaded");
+        return -1;
+    }
+    if (vm->callLevel)
+    {
+        vm->lastError = VM_SNAPSHOT_ON_RUNNING_VM;
+        Com_Error(vm->lastError, "VM_Snapshot on running vm");
+        return -1;
+    }
+
+    /* the stack is not used between two calls, so leave it out */
+    snapshot->dataLength =
+        (vm->stackBottom > 0) ? vm->stackBottom : vm->dataLength;
+    snapshot->dataMask     = vm->dataMask;
+    snapshot->programStack = vm->programStack;
+    snapshot->heapTop      = vm->heapTop;
+
+#ifdef USE_COW_INSTANCES
+    if (trackPages)
+    {
+        /* run the vm on a private mapping of the snapshot: the kernel then
+           knows the modified pages and VM_Restore just maps it again */
+        snapshot->fd =
+            VM_CreateDataFile(vm, vm->dataBase, snapshot->dataLength);
+        if (snapshot->fd > 0 && VM_MapData(vm, snapshot->fd) == 0)
+        {
+            return 0;
+        }
+        if (snapshot->fd > 0)
+        {
+            close(snapshot->fd);
+        }
+        snapshot->fd = 0; /* fall back to a copy */
+    }
+#else
+    (void)trackPages;
+#endif
+
+    snapshot->data = (uint8_t*)Com_malloc(snapshot->dataLength, vm,
+                                          VM_ALLOC_DATA_SEC);
+    if (snapshot->data == NULL)
+    {
+        vm->lastError = VM_MALLOC_FAILED;
+        Com_Error(vm->lastError, "Snapshot malloc failed: out of memory?");
+        return -1;
+    }
+    Com_Memcpy(snapshot->data, vm->dataBase, snapshot->dataLength);
+
+    return 0;
+}
+
+int VM_Restore(vm_t* vm, const vmSnapshot_t* snapshot)
+{
+    if (vm == NULL || snapshot == NULL)
+    {
+        Com_Error(VM_INVALID_POINTER, "Invalid vm pointer");
+        return -1;
+    }
+    if (vm->callLevel)
+    {
+        vm->lastError = VM_SNAPSHOT_ON_RUNNING_VM;
+        Com_Error(vm->lastError, "VM_Restore on running vm");
+        return -1;
+    }
+    if (!vm->dataBase || snapshot->dataMask != vm->dataMask ||
+        snapshot->dataLength !=
+            ((vm->stackBottom > 0) ? vm->stackBottom : vm->dataLength) ||
+        (!snapshot->data && snapshot->fd <= 0))
+    {
+        vm->lastError = VM_SNAPSHOT_MISMATCH;
+        Com_Error(vm->lastError, "Snapshot does not fit to vm");
+        return -1;
+    }
+
+#ifdef USE_COW_INSTANCES
+    if (snapshot->fd > 0)
+    {
+        /* drops the modified pages, the others are still the snapshot */
+        if (VM_MapData(vm, snapshot->fd) != 0)
+        {
+            vm->lastError = VM_MALLOC_FAILED;
+            Com_Error(vm->lastError, "Data mmap failed: out of memory?");
+            return -1;
+        }
+    }
+    else
+#endif
+    {
+        Com_Memcpy(vm->dataBase, snapshot->data, snapshot->dataLength);
+    }
+    vm->programStack = snapshot->programStack;
+    vm->heapTop      = snapshot->heapTop;
+
+    return 0;
+}
+
+void VM_FreeSnapshot(vm_t* vm, vmSnapshot_t* snapshot)
+{
+    if (!snapshot)
+    {
+        return;
+    }
+    if (snapshot->data)
+    {
+        Com_free(snapshot->data, vm, VM_ALLOC_DATA_SEC);
+    }
+#ifdef USE_COW_INSTANCES
+    if (snapshot->fd > 0)
+    {
+        close(snapshot->fd); /* a mapping of the file stays valid */
+    }
+#endif
+    Com_Memset(snapshot, 0, sizeof(*snapshot));
+}
+
+int VM_SetBudget(vm_t* vm, int limit)
+{
+    vmBudget_t* budget;
+    const int*  code;
+    int         i;
+    int         pc;
+    int         op;
+    int         target;
+
+    if (vm == NULL)
+    {
+        Com_Error(VM_INVALID_POINTER, "Invalid vm pointer");
+        return -1;
+    }
+    if (limit <= 0 || vm->budget)
+    {
+        if (vm->budget)
+        {
+            vm->budget->limit = limit > 0 ? limit : 0;
+        }
+        return 0;
+    }
+    if (vm->codeLength < 1)
+    {
+        vm->lastError = VM_NOT_LOADED;
+        Com_Error(vm->lastError, "VM not loaded");
+        return -1;
+    }
+
+    /* one block: state, code image, budget point flags */
+    budget = (vmBudget_t*)Com_malloc(sizeof(vmBudget_t) +
+                                         vm->codeLength * sizeof(intptr_t) +
+                                         vm->codeLength,
+                                     vm, VM_ALLOC_CODE_SEC);
+    if (!budget)
+    {
+        vm->lastError = VM_MALLOC_FAILED;
+        Com_Error(vm->lastError, "Budget malloc failed: out of memory?");
+        return -1;
+    }
+    Com_Memset(budget, 0, sizeof(vmBudget_t));
+    budget->code  = budget + 1;
+    budget->point = (uint8_t*)((intptr_t*)budget->code + vm->codeLength);
+    Com_Memset(budget->point, 0, vm->codeLength);
+
+    code = (const int*)vm->codeBase;
+#ifdef USE_DIRECT_THREADING
+    Com_Memcpy(budget->code, vm->threadedCode,
+               vm->codeLength * sizeof(intptr_t));
+#else
+    Com_Memcpy(budget->code, code, vm->codeLength * sizeof(int));
+#endif
+
+    /* every loop has a backward jump, every recursion an OP_ENTER. The
+       jump targets are already positions in vm->codeBase. */
+    for (i = 0; i < vm->instructionCount; i++)
+    {
+        pc     = vm->instructionPointers[i];
+        op     = code[pc];
+        target = pc + 1; /* forward: no budget point */
+        if (op == OP_ENTER || op == OP_JUMP)
+        {
+            target = pc; /* OP_JUMP: target unknown until it runs */
+        }
+        else if (op >= OP_EQ && op <= OP_GEF)
+        {
+            target = code[pc + 1];
+        }
+        else if (op == OP_CONST_JUMP)
+        {
+            target = vm->instructionPointers[code[pc + 1]];
+        }
+        else if (op >= OP_CONST_EQ && op <= OP_CONST_GEU)
+        {
+            target = code[pc + 3];
+        }
+        if (target <= pc)
+        {
+            budget->point[pc] = 1;
+#ifdef USE_DIRECT_THREADING
+            ((intptr_t*)budget->code)[pc] = vm_budgetHandler;
+#else
+            ((int*)budget->code)[pc] = OP_BUDGET;
+#endif
+        }
+    }
+
+    budget->limit = limit;
+    vm->budget    = budget;
+
+    return 0;
+}
+
+int VM_Profile(vm_t* vm, int enable)
+{
+    const vm_t*   module;
+    vmProfiler_t* profiler;
+    const int*    code;
+    size_t        size;
+    int           numFunctions;
+    int           numNodes;
+    int           function;
+    int           i;
+    int           pc;
+
+    if (vm == NULL)
+    {
+        Com_Error(VM_INVALID_POINTER, "Invalid vm pointer");
+        return -1;
+    }
+    if (vm->callLevel)
+    {
+        vm->lastError = VM_PROFILE_ON_RUNNING_VM;
+        Com_Error(vm->lastError, "VM_Profile on running vm");
+        return -1;
+    }
+    if (!enable)
+    {
+        vm->profiling = 0;
+        return 0;
+    }
+    if (vm->codeLength < 1)
+    {
+        vm->lastError = VM_NOT_LOADED;
+        Com_Error(vm->lastError, "VM not loaded");
+        return -1;
+    }
+
+    /* the functions start with OP_ENTER */
+    code         = (const int*)vm->codeBase;
+    numFunctions = 0;
+    for (i = 0; i < vm->instructionCount; i++)
+    {
+        if (code[vm->instructionPointers[i]] == OP_ENTER)
+        {
+            numFunctions++;
+        }
+    }
+    if (numFunctions < 1)
+    {
+        numFunctions = 1; /* unverified code: count everything for one */
+    }
+
+    /* one block: state, code image, functions, call tree of the samples,
+       function of every int */
+    numNodes = vm->sampleInterval > 0 ? VM_PROFILE_MAX_NODES : 0;
+    size     = sizeof(vmProfiler_t) + vm->codeLength * sizeof(intptr_t) +
+           numFunctions * sizeof(vmProfileFunction_t) +
+           numNodes * sizeof(vmProfileNode_t) +
+           (vm->codeLength + numFunctions) * sizeof(int);
+    if (vm->profiler)
+    {
+        Com_free(vm->profiler, vm, VM_ALLOC_DEBUG);
+    }
+    vm->profiling = 0;
+    vm->profiler  = (vmProfiler_t*)Com_malloc(size, vm, VM_ALLOC_DEBUG);
+    profiler      = vm->profiler;
+    if (!profiler)
+    {
+        vm->lastError = VM_MALLOC_FAILED;
+        Com_Error(vm->lastError, "Profiler malloc failed: out of memory?");
+        return -1;
+    }
+    Com_Memset(profiler, 0, size);
+    profiler->code = profiler + 1;
+    profiler->results.functions =
+        (vmProfileFunction_t*)((intptr_t*)profiler->code + vm->codeLength);
+    profiler->results.numFunctions = numFunctions;
+    profiler->nodes =
+        (vmProfileNode_t*)(profiler->results.functions + numFunctions);
+    profiler->functionOf = (int*)(profiler->nodes + numNodes);
+    profiler->active = profiler->functionOf + vm->codeLength;
+
+    /* the profiler runs every op code through OP_PROFILE */
+#ifdef USE_DIRECT_THREADING
+    Com_Memcpy(profiler->code, vm->threadedCode,
+               vm->codeLength * sizeof(intptr_t));
+#else
+    Com_Memcpy(profiler->code, code, vm->codeLength * sizeof(int));
+#endif
+    function = 0;
+    numFunctions = 0;
+    for (i = 0; i < vm->instructionCount; i++)
+    {
+        pc = vm->instructionPointers[i];
+        if (code[pc] == OP_ENTER)
+        {
+            function = numFunctions++;
+            profiler->results.functions[function].function = i;
+        }
+#ifdef USE_DIRECT_THREADING
+        ((intptr_t*)profiler->code)[pc] = vm_profileHandler;
+#else
+        ((int*)profiler->code)[pc] = OP_PROFILE;
+#endif
+        /* the operands belong to the same function */
+        for (; pc < vm->codeLength &&
+               (i + 1 >= vm->instructionCount ||
+                pc < vm->instructionPointers[i + 1]);
+             pc++)
+        {
+            profiler->functionOf[pc] = function;
+        }
+    }
+
+    /* names of the functions */
+    module = vm->module ? vm->module : vm;
+    for (i = 0; i < numFunctions; i++)
+    {
+        const vmSymbol_t* sym;
+        pc  = vm->instructionPointers[profiler->results.functions[i].function];
+        sym = VM_FindSymbol(module, pc);
+        if (sym && sym->symValue == pc)
+        {
+            profiler->results.functions[i].name = sym->symName;
+        }
+    }
+
+    /* node 0 is the root of the call tree */
+    if (numNodes > 0)
+    {
+        profiler->nodes[0].function = -1;
+        profiler->numNodes          = 1;
+        profiler->countdown         = vm->sampleInterval;
+    }
+
+    vm->profiling = 1;
+
+    return 0;
+}
+
+const vmProfile_t* VM_GetProfile(const vm_t* vm)
+{
+    if (vm == NULL || vm->profiler == NULL)
+    {
+        return NULL;
+    }
+    return &vm->profiler->results;
+}
+
+int VM_ProfileSampling(vm_t* vm, int interval)
+{
+    if (vm == NULL)
+    {
+        Com_Error(VM_INVALID_POINTER, "Invalid vm pointer");
+        return -1;
+    }
+    vm->sampleInterval = interval > 0 ? interval : 0;
+    return 0;
+}
+
+int VM_GetFoldedStacks(const vm_t* vm, char* buffer, int size)
+{
+    const vmProfiler_t* profiler;
+    int                 path[VM_PROFILE_MAX_DEPTH];
+    int                 depth;
+    int                 length;
+    int                 function;
+    int                 node;
+    int                 i;
+
+    if (buffer && size > 0)
+    {
+        buffer[0] = '\0';
+    }
+    if (vm == NULL || vm->profiler == NULL)
+    {
+        return 0;
+    }
+    profiler = vm->profiler;
+
+    /* depth first through the call tree, path holds the call stack */
+    length = 0;
+    depth  = 0;
+    node   = profiler->numNodes > 0 ? profiler->nodes[0].child : 0;
+    while (node)
+    {
+        path[depth++] = node;
+        if (profiler->nodes[node].samples)
+        {
+            for (i = 0; i < depth; i++)
+            {
+                function = profiler->nodes[path[i]].function;
+                length += VM_AppendFoldedName(
+                    buffer, size, length,
+                    &profiler->results.functions[function],
+                    i + 1 < depth ? ';' : ' ');
+            }
+            length += snprintf(length < size ? buffer + length : NULL,
+                               length < size ? size - length : 0, "%lu\n",
+                               (unsigned long)profiler->nodes[node].samples);
+        }
+        if (profiler->nodes[node].child)
+        {
+            node = profiler->nodes[node].child;
+            continue;
+        }
+        /* no callees: next callee of this function or of its callers */
+        node = 0;
+        while (depth > 0 && !node)
+        {
+            node = profiler->nodes[path[--depth]].sibling;
+        }
+    }
+
+    return length;
+}
+
+const char* VM_OpcodeName(int opcode)
+{
+    if (opcode < 0 || opcode >= OPCODE_TABLE_SIZE)
+    {
+        return NULL;
+    }
+    return opnames[opcode];
+}
+
+void* VM_ArgPtr(intptr_t vmAddr, vm_t* vm)
+{
+    if (!vmAddr)
+    {
+        return NULL;
+    }
+    if (vm == NULL)
+    {
+        Com_Error(VM_INVALID_POINTER, "Invalid VM pointer");
+        return NULL;
+    }
+
+#if defined(USE_GUARD_PAGES) || defined(USE_BOUNDS_CHECK)
+    /* nothing to mask, and the host doesn't run with the fault handler of
+       VM_Run */
+    if ((uint32_t)vmAddr >= (uint32_t)vm->dataLength)
+    {
+        return (void*)vm->dataBase;
+    }
+    return (void*)(vm->dataBase + (uint32_t)vmAddr);
+#else
     return (void*)(vm->dataBase + (vmAddr & vm->dataMask));
+#endif
+}
+
+float VM_IntToFloat(int32_t x)
+{
+    union {
+        float    f;  /**< float IEEE 754 32-bit single */
+        int32_t  i;  /**< int32 part */
+        uint32_t ui; /**< unsigned int32 part */
+    } fi;
+    fi.i = x;
+    return fi.f;
+}
+
+int32_t VM_FloatToInt(float f)
+{
+    union {
+        float    f;  /**< float IEEE 754 32-bit single */
+        int32_t  i;  /**< int32 part */
+        uint32_t ui; /**< unsigned int32 part */
+    } fi;
+    fi.f = f;
+    return fi.i;
+}
+
+int VM_MemoryRangeValid(intptr_t vmAddr, size_t len, const vm_t* vm)
+{
+    size_t dest;
+    size_t length;
+
+    if (!vmAddr || !vm)
+    {
+        return -1;
+    }
+    dest   = (unsigned)vmAddr;
+    length = (unsigned)vm->dataLength;
+    if (dest >= length || len > length - dest)
+    {
+        Com_Error(VM_DATA_OUT_OF_RANGE, "Memory access out of range");
+        return -1;
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+#if defined(USE_COW_INSTANCES) || defined(USE_GUARD_PAGES)
+static size_t VM_DataMapLength(const vm_t* vm)
+{
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    return ((size_t)vm->dataAlloc + pageSize - 1) & ~(pageSize - 1);
+}
+#endif
+
+#ifdef USE_COW_INSTANCES
+
+static int VM_CreateDataFile(const vm_t* vm, const uint8_t* data, int length)
+{
+    int fd = memfd_create("q3vm-data", MFD_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    /* the file is zero filled, so .bss is never written */
+    if (fd == 0 || ftruncate(fd, (off_t)VM_DataMapLength(vm)) != 0 ||
+        pwrite(fd, data, length, 0) != (ssize_t)length)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int VM_MapData(vm_t* vm, int fd)
+{
+    void* p;
+
+#ifdef USE_GUARD_PAGES
+    /* replace the accessible pages, the guard pages stay */
+    if (!vm->dataBase && VM_AllocData(vm) != 0)
+    {
+        return -1;
+    }
+    p = mmap(vm->dataBase, VM_DataMapLength(vm), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        VM_FreeData(vm); /* the old pages might be gone */
+        return -1;
+    }
+#else
+    p = mmap(NULL, VM_DataMapLength(vm), PROT_READ | PROT_WRITE, MAP_PRIVATE,
+             fd, 0);
+    if (p == MAP_FAILED)
+    {
+        return -1;
+    }
+    VM_FreeData(vm);
+#endif
+    vm->dataBase   = (uint8_t*)p;
+    vm->dataMapped = 1;
+    return 0;
+}
+#endif
+
+#ifdef USE_CODE_CACHE
+static uint32_t VM_HashCode(const uint8_t* code, int length)
+{
+    uint32_t hash = 2166136261u;
+    int      i;
+
+    for (i = 0; i < length; i++)
+    {
+        hash = (hash ^ code[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int VM_FindCodeImage(vm_t* vm, const uint8_t* code, uint32_t hash)
+{
+    vmCodeImage_t* image;
+
+    while (__sync_lock_test_and_set(&vm_codeCacheLock, 1))
+    {
+    }
+    for (image = vm_codeCache; image; image = image->next)
+    {
+        if (image->hash == hash && image->codeLength == vm->codeLength &&
+            image->instructionCount == vm->instructionCount &&
+            image->dataLength == vm->dataLength &&
+            image->stackSize == vm->stackSize &&
+            image->pooled == vm->pooled &&
+            memcmp(image->code, code, vm->codeLength) == 0)
+        {
+            image->refCount++;
+            break;
+        }
+    }
+    __sync_lock_release(&vm_codeCacheLock);
+
+    if (!image)
+    {
+        return -1;
+    }
+    vm->codeImage           = image;
+    vm->codeBase            = image->codeBase;
+    vm->instructionPointers = image->instructionPointers;
+    vm->threadedCode        = image->threadedCode;
+    vm->fusionCount         = image->fusionCount;
+    vm->verified            = image->verified;
+    vm->compiled            = image->compiled;
+    vm->jitCode             = image->jitCode;
+    vm->jitCodeLength       = image->jitCodeLength;
+    return 0;
+}
+
+static void VM_AddCodeImage(vm_t* vm, const uint8_t* code, uint32_t hash)
+{
+    vmCodeImage_t* image = (vmCodeImage_t*)Com_malloc(
+        sizeof(vmCodeImage_t) + vm->codeLength, vm, VM_ALLOC_CODE_SEC);
+    if (!image)
+    {
+        return;
+    }
+    image->refCount            = 1;
+    image->hash                = hash;
+    image->codeLength          = vm->codeLength;
+    image->instructionCount    = vm->instructionCount;
+    image->dataLength          = vm->dataLength;
+    image->stackSize           = vm->stackSize;
+    image->pooled              = vm->pooled;
+    image->codeBase            = vm->codeBase;
+    image->instructionPointers = vm->instructionPointers;
+    image->threadedCode        = vm->threadedCode;
+    image->fusionCount         = vm->fusionCount;
+    image->verified            = vm->verified;
+    image->compiled            = vm->compiled;
+    image->jitCode             = vm->jitCode;
+    image->jitCodeLength       = vm->jitCodeLength;
+    Com_Memcpy(image->code, code, vm->codeLength);
+    vm->codeImage = image;
+
+    while (__sync_lock_test_and_set(&vm_codeCacheLock, 1))
+    {
+    }
+    image->next  = vm_codeCache;
+    vm_codeCache = image;
+    __sync_lock_release(&vm_codeCacheLock);
+}
+
+static void VM_ReleaseCodeImage(vm_t* vm)
+{
+    vmCodeImage_t*  image = vm->codeImage;
+    vmCodeImage_t** p;
+    int             last;
+
+    while (__sync_lock_test_and_set(&vm_codeCacheLock, 1))
+    {
+    }
+    last = (--image->refCount == 0);
+    if (last)
+    {
+        for (p = &vm_codeCache; *p != image; p = &(*p)->next)
+        {
+        }
+        *p = image->next;
+    }
+    __sync_lock_release(&vm_codeCacheLock);
+
+    vm->codeImage = NULL;
+    if (last)
+    {
+        /* the code itself is released by VM_Free */
+        Com_free(image, vm, VM_ALLOC_CODE_SEC);
+        return;
+    }
+    vm->codeBase            = NULL;
+    vm->instructionPointers = NULL;
+    vm->threadedCode        = NULL;
+    vm->jitCode             = NULL;
+}
+#endif
+
+static void* VM_PoolAlloc(size_t size, vm_t* vm, vmMallocType_t type)
+{
+#ifdef USE_ALLOC_POOL
+    vmPoolBlock_t* block = NULL;
+    size_t         classSize;
+    int            sizeClass;
+
+    if (vm->pooled)
+    {
+        sizeClass = VM_PoolSizeClass(size, &classSize);
+        if (sizeClass >= 0)
+        {
+            while (__sync_lock_test_and_set(&vm_poolLock, 1))
+            {
+            }
+            block = vm_pool[type][sizeClass];
+            if (block)
+            {
+                vm_pool[type][sizeClass] = block->s.next;
+                vm_poolCount[type][sizeClass]--;
+            }
+            __sync_lock_release(&vm_poolLock);
+        }
+        else
+        {
+            classSize = size;
+        }
+        if (!block)
+        {
+            block = (vmPoolBlock_t*)Com_malloc(sizeof(vmPoolBlock_t) +
+                                                   classSize,
+                                               vm, type);
+            if (!block)
+            {
+                return NULL;
+            }
+            block->s.sizeClass = sizeClass;
+        }
+        return block + 1;
+    }
+#endif
+    return Com_malloc(size, vm, type);
+}
+
+static void VM_PoolFree(void* p, vm_t* vm, vmMallocType_t type)
+{
+#ifdef USE_ALLOC_POOL
+    vmPoolBlock_t* block;
+    int            sizeClass;
+
+    if (vm->pooled)
+    {
+        block     = (vmPoolBlock_t*)p - 1;
+        sizeClass = block->s.sizeClass;
+        if (sizeClass >= 0)
+        {
+            while (__sync_lock_test_and_set(&vm_poolLock, 1))
+            {
+            }
+            if (vm_poolCount[type][sizeClass] < VM_POOL_MAX_BLOCKS)
+            {
+                block->s.next            = vm_pool[type][sizeClass];
+                vm_pool[type][sizeClass] = block;
+                vm_poolCount[type][sizeClass]++;
+                block = NULL;
+            }
+            __sync_lock_release(&vm_poolLock);
+        }
+        if (block)
+        {
+            Com_free(block, vm, type);
+        }
+        return;
+    }
+#endif
+    Com_free(p, vm, type);
+}
+
+#ifdef USE_ALLOC_POOL
+static int VM_PoolSizeClass(size_t size, size_t* classSize)
+{
+    size_t limit     = 256;
+    size_t step      = 64;
+    int    sizeClass = 0;
+
+    /* 256, 320, 384, 448, 512, 640, ...: at most 25% unused */
+    while (limit < size)
+    {
+        limit += step;
+        if (limit == 8 * step)
+        {
+            step *= 2;
+        }
+        if (++sizeClass >= VM_POOL_CLASSES)
+        {
+            return -1;
+        }
+    }
+    *classSize = limit;
+    return sizeClass;
+}
+#endif
+
+static int VM_AllocData(vm_t* vm)
+{
+#ifdef USE_GUARD_PAGES
+    struct sigaction action;
+    void*            p;
+
+    while (__sync_lock_test_and_set(&vm_guardLock, 1))
+    {
+    }
+    if (!vm_guardInstalled)
+    {
+        Com_Memset(&action, 0, sizeof(action));
+        action.sa_sigaction = VM_GuardHandler;
+        action.sa_flags     = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGSEGV, &action, &vm_guardOldSegv) == 0 &&
+            sigaction(SIGBUS, &action, &vm_guardOldBus) == 0)
+        {
+            vm_guardInstalled = 1;
+        }
+    }
+    __sync_lock_release(&vm_guardLock);
+    if (!vm_guardInstalled)
+    {
+        return -1;
+    }
+
+    /* only address space: the pages are mapped by mprotect */
+    p = mmap(NULL, VM_GUARD_LENGTH, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        return -1;
+    }
+    if (mprotect(p, VM_DataMapLength(vm), PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(p, VM_GUARD_LENGTH);
+        return -1;
+    }
+    vm->dataBase = (uint8_t*)p; /* zero filled */
+#else
+    vm->dataBase = (uint8_t*)VM_PoolAlloc(vm->dataAlloc, vm, VM_ALLOC_DATA_SEC);
+    if (vm->dataBase == NULL)
+    {
+        return -1;
+    }
+    Com_Memset(vm->dataBase, 0, vm->dataAlloc);
+#endif
+    return 0;
+}
+
+static void VM_FreeData(vm_t* vm)
+{
+#ifdef USE_GUARD_PAGES
+    if (vm->dataBase)
+    {
+        munmap(vm->dataBase, VM_GUARD_LENGTH);
+    }
+#else
+#ifdef USE_COW_INSTANCES
+    if (vm->dataMapped)
+    {
+        munmap(vm->dataBase, VM_DataMapLength(vm));
+    }
+    else
+#endif
+    if (vm->dataBase)
+    {
+        VM_PoolFree(vm->dataBase, vm, VM_ALLOC_DATA_SEC);
+    }
+#endif
+    vm->dataBase   = NULL;
+    vm->dataMapped = 0;
+}
+
+#ifdef USE_GUARD_PAGES
+static void VM_GuardHandler(int sig, siginfo_t* info, void* context)
+{
+    const vm_t*             vm   = vm_guardVm;
+    const uint8_t*          addr = (const uint8_t*)info->si_addr;
+    const struct sigaction* old =
+        (sig == SIGBUS) ? &vm_guardOldBus : &vm_guardOldSegv;
+
+    if (vm_guardJump && vm && addr >= vm->dataBase &&
+        addr < vm->dataBase + VM_GUARD_LENGTH)
+    {
+        siglongjmp(*vm_guardJump, 1);
+    }
+    /* not our fault: chain to the handler of the host, but stay installed
+       for the other VMs */
+    if (old->sa_flags & SA_SIGINFO)
+    {
+        old->sa_sigaction(sig, info, context);
+    }
+    else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN)
+    {
+        old->sa_handler(sig);
+    }
+    else
+    {
+        /* a fault can't be ignored: terminate as without the VM */
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+}
+#endif
+
+static void Q_strncpyz(char* dest, const char* src, int destsize)
+{
+    if (!dest || !src || destsize < 1)
+    {
+        return;
+    }
+    strncpy(dest, src, destsize - 1);
+    dest[destsize - 1] = 0;
+}
+
+static void VM_FreeSymbols(vm_t* vm)
+{
+    vmSymbol_t* sym = vm->symbols;
+    while (sym)
+    {
+        vmSymbol_t* next = sym->next;
+        Com_free(sym, vm, VM_ALLOC_DEBUG);
+        sym = next;
+    }
+    vm->symbols    = NULL;
+    vm->numSymbols = 0;
+
+    if (vm->symbolTable)
+    {
+        Com_free(vm->symbolTable, vm, VM_ALLOC_DEBUG);
+        vm->symbolTable = NULL;
+    }
+}
+
+static int VM_SymbolSort(const void* a, const void* b)
+{
+    const vmSymbol_t* sa = *(const vmSymbol_t* const*)a;
+    const vmSymbol_t* sb = *(const vmSymbol_t* const*)b;
+
+    if (sa->symValue < sb->symValue)
+    {
+        return -1;
+    }
+    if (sa->symValue > sb->symValue)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+static vmSymbol_t* VM_FindSymbol(const vm_t* vm, int value)
+{
+    int low, high, mid;
+
+    if (vm->module)
+    {
+        vm = vm->module; /* the symbols belong to the module */
+    }
+    if (!vm->symbolTable)
+    {
+        return NULL;
+    }
+
+    /* last symbol with symValue <= value */
+    low  = 0;
+    high = vm->numSymbols - 1;
+    while (low < high)
+    {
+        mid = low + (high - low + 1) / 2;
+        if (vm->symbolTable[mid]->symValue <= value)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+
+    return vm->symbolTable[low];
+}
+
+static int ParseHex(const char* text)
+{
+    int value;
+    int c;
+
+    value = 0;
+    while ((c = *text++) != 0)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            value = value * 16 + c - '0';
+            continue;
+        }
+        if (c >= 'a' && c <= 'f')
+        {
+            value = value * 16 + 10 + c - 'a';
+            continue;
+        }
+        if (c >= 'A' && c <= 'F')
+        {
+            value = value * 16 + 10 + c - 'A';
+            continue;
+        }
+    }
+
+    return value;
 }
 
-float VM_IntToFloat(int32_t x)
+static char* SkipWhitespace(char* data, int* hasNewLines)
 {
-    union {
-        float    f;  /**< float IEEE 754 32-bit single */
-        int32_t  i;  /**< int32 part */
-        uint32_t ui; /**< unsigned int32 part */
-    } fi;
-    fi.i = x;
-    return fi.f;
+    int c;
+
+    while ((c = *data) <= ' ')
+    {
+        if (!c)
+        {
+            return NULL;
+        }
+        if (c == '\n')
+        {
+            *hasNewLines = 1;
+        }
+        data++;
+    }
+
+    return data;
 }
 
-int32_t VM_FloatToInt(float f)
+static char* COM_Parse(char** data_p, char* com_token)
 {
-    union {
-        float    f;  /**< float IEEE 754 32-bit single */
-        int32_t  i;  /**< int32 part */
-        uint32_t ui; /**< unsigned int32 part */
-    } fi;
-    fi.f = f;
-    return fi.i;
+    int   c           = 0, len;
+    int   hasNewLines = 0;
+    char* data;
+    int   allowLineBreaks = 1;
+
+    data         = *data_p;
+    len          = 0;
+    com_token[0] = 0;
+
+    /* make sure incoming data is valid */
+    if (!data)
+    {
+        *data_p = NULL;
+        return com_token;
+    }
+
+    while (1)
+    {
+        /* skip whitespace */
+        data = SkipWhitespace(data, &hasNewLines);
+        if (!data)
+        {
+            *data_p = NULL;
+            return com_token;
+        }
+        if (hasNewLines && !allowLineBreaks)
+        {
+            *data_p = data;
+            return com_token;
+        }
+
+        c = *data;
+
+        /* skip double slash comments */
+        if (c == '/' && data[1] == '/')
+        {
+            data += 2;
+            while (*data && *data != '\n')
+            {
+                data++;
+            }
+        }
+        /* skip comments */
+        else if (c == '/' && data[1] == '*')
+        {
+            data += 2;
+            while (*data && (*data != '*' || data[1] != '/'))
+            {
+                data++;
+            }
+            if (*data)
+            {
+                data += 2;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    /* handle quoted strings */
+    if (c == '\"')
+    {
+        data++;
+        while (1)
+        {
+            c = *data++;
+            if (c == '\"' || !c)
+            {
+                com_token[len] = 0;
+                *data_p        = (char*)data;
+                return com_token;
+            }
+            if (len < MAX_TOKEN_CHARS - 1)
+            {
+                com_token[len] = c;
+                len++;
+            }
+        }
+    }
+
+    /* parse a regular word */
+    do
+    {
+        if (len < MAX_TOKEN_CHARS - 1)
+        {
+            com_token[len] = c;
+            len++;
+        }
+        data++;
+        c = *data;
+    } while (c > 32);
+
+    com_token[len] = 0;
+
+    *data_p = (char*)data;
+    return com_token;
 }
 
-int VM_MemoryRangeValid(intptr_t vmAddr, size_t len, const vm_t* vm)
+
+static void VM_BlockCopy(unsigned int dest, unsigned int src, size_t n,
+                         vm_t* vm)
 {
-    if (!vmAddr || !vm)
+    const size_t length = (unsigned)vm->dataLength;
+
+    if (dest >= length || n > length - dest || src >= length ||
+        n > length - src)
     {
-        return -1;
+        Com_Error(vm->lastError = VM_BLOCKCOPY_OUT_OF_RANGE,
+                  "OP_BLOCK_COPY out of range");
+        return;
+    }
+
+    Com_Memcpy(vm->dataBase + dest, vm->dataBase + src, n);
+}
+
+static intptr_t VM_SystemCall(vm_t* vm, int programStack)
+{
+    int* imagePtr = (int*)&vm->dataBase[programStack + 4];
+    const unsigned int id = (unsigned int)imagePtr[0];
+    intptr_t (*systemCall)(vm_t*, intptr_t*) = vm->systemCall;
+    int argc = MAX_VMSYSCALL_ARGS - 1;
+    intptr_t r;
+#ifdef USE_GUARD_PAGES
+    sigjmp_buf* const jump = vm_guardJump;
+#endif
+
+    /* registered handler: only convert the declared arguments */
+    if (id < (unsigned int)vm->numSystemCalls)
+    {
+        if (vm->systemCalls[id].intrinsic)
+        {
+            return VM_CallIntrinsic(vm, vm->systemCalls[id].intrinsic,
+                                    &imagePtr[1]);
+        }
+        if (vm->systemCalls[id].function)
+        {
+            systemCall = vm->systemCalls[id].function;
+            argc       = vm->systemCalls[id].argc;
+        }
     }
-    const unsigned dest     = vmAddr;
-    const unsigned dataMask = vm->dataMask;
-    if ((dest & dataMask) != dest || ((dest + len) & dataMask) != dest + len)
+
+#ifdef USE_GUARD_PAGES
+    /* a fault in the host is not a fault of the vm */
+    vm_guardJump = NULL;
+#endif
+    /* the vm has ints on the stack, we expect
+       pointers so we might have to convert it */
+    if (sizeof(intptr_t) != sizeof(int))
     {
-        Com_Error(VM_DATA_OUT_OF_RANGE, "Memory access out of range");
-        return -1;
+        intptr_t argarr[MAX_VMSYSCALL_ARGS];
+        int      i;
+        for (i = 0; i <= argc; ++i)
+        {
+            argarr[i] = imagePtr[i];
+        }
+        r = systemCall(vm, argarr);
     }
     else
     {
+        r = systemCall(vm, (intptr_t*)imagePtr);
+    }
+#ifdef USE_GUARD_PAGES
+    vm_guardJump = jump;
+#endif
+    return r;
+}
+
+static int VM_CallIntrinsic(vm_t* vm, vmIntrinsic_t intrinsic,
+                            const int* args)
+{
+    uint8_t*     image = vm->dataBase;
+    unsigned int length;
+    uint8_t*     end;
+    int          address;
+
+    switch (intrinsic)
+    {
+    case VM_INTRINSIC_MEMSET:
+        if (VM_MemoryRangeValid(args[0], (unsigned int)args[2], vm) == 0)
+        {
+            Com_Memset(&image[args[0]], args[1], (unsigned int)args[2]);
+        }
+        return args[0];
+    case VM_INTRINSIC_MEMCPY: /* memmove: overlapping ranges are harmless */
+    case VM_INTRINSIC_MEMMOVE:
+        if (VM_MemoryRangeValid(args[0], (unsigned int)args[2], vm) == 0 &&
+            VM_MemoryRangeValid(args[1], (unsigned int)args[2], vm) == 0)
+        {
+            memmove(&image[args[0]], &image[args[1]], (unsigned int)args[2]);
+        }
+        return args[0];
+    case VM_INTRINSIC_STRLEN:
+        if (VM_MemoryRangeValid(args[0], 0, vm) != 0)
+        {
+            return 0;
+        }
+        /* the string ends at the end of the data segment at the latest */
+        length = vm->dataLength - (unsigned int)args[0];
+        end    = (uint8_t*)memchr(&image[args[0]], 0, length);
+        return end ? (int)(end - &image[args[0]]) : (int)length;
+    case VM_INTRINSIC_SQRT:
+        return VM_FloatToInt((float)sqrt(VM_IntToFloat(args[0])));
+    case VM_INTRINSIC_SIN:
+        return VM_FloatToInt((float)sin(VM_IntToFloat(args[0])));
+    case VM_INTRINSIC_COS:
+        return VM_FloatToInt((float)cos(VM_IntToFloat(args[0])));
+    case VM_INTRINSIC_FLOOR:
+        return VM_FloatToInt((float)floor(VM_IntToFloat(args[0])));
+    case VM_INTRINSIC_MALLOC:
+        /* heapLength is padded, so a fitting block fits padded, too */
+        length = (unsigned int)args[0];
+        if (length > (unsigned int)(vm->heapBase + vm->heapLength) -
+                         (unsigned int)vm->heapTop)
+        {
+            return 0; /* NULL: the heap is full */
+        }
+        address = vm->heapTop;
+        vm->heapTop += PAD(length, 16u);
+        return address;
+    case VM_INTRINSIC_HEAPMARK:
+        return vm->heapTop;
+    case VM_INTRINSIC_HEAPRESET:
+        /* a mark above heapTop is stale: its memory is freed already. Only
+           aligned marks keep heapTop within the heap. */
+        if (args[0] >= vm->heapBase && args[0] <= vm->heapTop &&
+            ((args[0] - vm->heapBase) & 15) == 0)
+        {
+            vm->heapTop = args[0];
+        }
+        return 0;
+    case VM_INTRINSIC_HEAPFREEALL:
+        vm->heapTop = vm->heapBase;
+        return 0;
+    default:
         return 0;
     }
 }
 
-static void Q_strncpyz(char* dest, const char* src, int destsize)
+static void VM_ProfileInstruction(vm_t* vm, int opcode, int programCounter,
+                                  int programStack)
 {
-    if (!dest || !src || destsize < 1)
+    vmProfiler_t* profiler = vm->profiler;
+    const int     function = profiler->functionOf[programCounter];
+    const int     op       = opcode & OPCODE_TABLE_MASK;
+    int           returning;
+
+    profiler->results.instructions++;
+    profiler->results.opcodeCount[op]++;
+    if (profiler->lastOpcode >= 0)
     {
-        return;
+        profiler->results.opcodePairs[profiler->lastOpcode][op]++;
+    }
+    profiler->lastOpcode = op;
+    if (profiler->countdown > 0 && --profiler->countdown == 0)
+    {
+        if (opcode == OP_ENTER)
+        {
+            profiler->countdown = 1; /* no frame yet, take the next one */
+        }
+        else
+        {
+            VM_ProfileSample(vm, programCounter, programStack);
+            profiler->countdown = vm->sampleInterval;
+        }
+    }
+    profiler->results.functions[function].exclusive++;
+
+    if (opcode == OP_ENTER)
+    {
+        profiler->results.functions[function].calls++;
+        if (profiler->depth < VM_PROFILE_MAX_DEPTH)
+        {
+            profiler->stack[profiler->depth].function = function;
+            profiler->stack[profiler->depth].start =
+                profiler->results.instructions - 1;
+            profiler->active[function]++;
+        }
+        profiler->depth++;
+    }
+    else if (opcode == OP_LEAVE && profiler->depth > 0)
+    {
+        profiler->depth--;
+        if (profiler->depth < VM_PROFILE_MAX_DEPTH)
+        {
+            returning = profiler->stack[profiler->depth].function;
+            /* recursion: only the outermost call counts */
+            if (--profiler->active[returning] == 0)
+            {
+                profiler->results.functions[returning].inclusive +=
+                    profiler->results.instructions -
+                    profiler->stack[profiler->depth].start;
+            }
+        }
     }
-    strncpy(dest, src, destsize - 1);
-    dest[destsize - 1] = 0;
 }
 
-static void VM_BlockCopy(unsigned int dest, unsigned int src, size_t n,
-                         vm_t* vm)
+static int VM_AppendFoldedName(char* buffer, int size, int length,
+                               const vmProfileFunction_t* f, char separator)
 {
-    unsigned int dataMask = vm->dataMask;
+    char* out  = length < size ? buffer + length : NULL;
+    int   left = length < size ? size - length : 0;
 
-    if ((dest & dataMask) != dest || (src & dataMask) != src ||
-        ((dest + n) & dataMask) != dest + n ||
-        ((src + n) & dataMask) != src + n)
+    if (f->name)
     {
-        Com_Error(vm->lastError = VM_BLOCKCOPY_OUT_OF_RANGE,
-                  "OP_BLOCK_COPY out of range");
-        return;
+        return snprintf(out, left, "%s%c", f->name, separator);
     }
+    return snprintf(out, left, "@%i%c", f->function, separator);
+}
 
-    Com_Memcpy(vm->dataBase + dest, vm->dataBase + src, n);
+static void VM_ProfileSample(vm_t* vm, int programCounter, int programStack)
+{
+    vmProfiler_t* profiler = vm->profiler;
+    const int*    code     = (const int*)vm->codeBase;
+    int           stack[VM_PROFILE_MAX_DEPTH];
+    int           depth = 0;
+    int           function;
+    int           instruction;
+    int           entry;
+    int           node;
+    int           child;
+
+    profiler->results.samples++;
+    while (depth < VM_PROFILE_MAX_DEPTH)
+    {
+        function       = profiler->functionOf[programCounter];
+        stack[depth++] = function;
+        instruction    = profiler->results.functions[function].function;
+        entry          = (int)vm->instructionPointers[instruction];
+        if (code[entry] != OP_ENTER)
+        {
+            break; /* unverified code without functions */
+        }
+        /* the frame of the caller starts at the saved return address */
+        programStack += code[entry + 1];
+        if ((unsigned)programStack > (unsigned)(vm->dataLength - 4))
+        {
+            break;
+        }
+        programCounter = *(int*)&vm->dataBase[programStack];
+        if ((unsigned)programCounter >= (unsigned)vm->codeLength)
+        {
+            break; /* -1: start of the VM call */
+        }
+    }
+
+    /* follow the call tree from the outermost call */
+    node = 0;
+    while (depth > 0)
+    {
+        depth--;
+        for (child = profiler->nodes[node].child; child;
+             child = profiler->nodes[child].sibling)
+        {
+            if (profiler->nodes[child].function == stack[depth])
+            {
+                break;
+            }
+        }
+        if (!child)
+        {
+            if (profiler->numNodes >= VM_PROFILE_MAX_NODES)
+            {
+                break;
+            }
+            child                           = profiler->numNodes++;
+            profiler->nodes[child].function = stack[depth];
+            profiler->nodes[child].sibling  = profiler->nodes[node].child;
+            profiler->nodes[node].child     = child;
+        }
+        node = child;
+    }
+    profiler->nodes[node].samples++;
 }
 
 static int LittleEndianToHost(const uint8_t b[4])
@@ -691,16 +3224,17 @@ static int LittleEndianToHost(const uint8_t b[4])
     return (b[0] << 0) | (b[1] << 8) | (b[2] << 16) | (b[3] << 24);
 }
 
-static int VM_PrepareInterpreter(vm_t* vm, const vmHeader_t* header)
+static int VM_PrepareInterpreter(vm_t* vm, const vmHeader_t* header,
+                                 const uint8_t* bytecode)
 {
-    int      op;
-    int      byte_pc;
-    int      int_pc;
-    uint8_t* code;
-    int      instruction;
-    int*     codeBase;
-
-    vm->codeBase = (uint8_t*)Com_malloc(
+    int            op;
+    int            byte_pc;
+    int            int_pc;
+    const uint8_t* code;
+    int            instruction;
+    int*           codeBase;
+
+    vm->codeBase = (uint8_t*)VM_PoolAlloc(
         vm->codeLength * 4, vm, VM_ALLOC_CODE_SEC); /* we're now int aligned */
     if (!vm->codeBase)
     {
@@ -709,14 +3243,11 @@ static int VM_PrepareInterpreter(vm_t* vm, const vmHeader_t* header)
         return -1;
     }
 
-    Com_Memcpy(vm->codeBase, (uint8_t*)header + header->codeOffset,
-               vm->codeLength);
-
     /* we don't need to translate the instructions, but we still need
        to find each instructions starting point for jumps */
     int_pc = byte_pc = 0;
     instruction      = 0;
-    code             = (uint8_t*)header + header->codeOffset;
+    code             = bytecode + header->codeOffset;
     codeBase         = (int*)vm->codeBase;
 
     /* Copy and expand instructions to words while
@@ -726,14 +3257,15 @@ static int VM_PrepareInterpreter(vm_t* vm, const vmHeader_t* header)
         vm->instructionPointers[instruction] = int_pc;
         instruction++;
 
-        op               = (int)code[byte_pc];
-        codeBase[int_pc] = op;
-        if (byte_pc > header->codeLength)
+        /* never read beyond the code segment */
+        if (byte_pc >= header->codeLength)
         {
             Com_Error(vm->lastError = VM_PC_OUT_OF_RANGE,
                       "VM_PrepareInterpreter: pc > header->codeLength");
             return -1;
         }
+        op               = (int)code[byte_pc];
+        codeBase[int_pc] = op;
 
         byte_pc++;
         int_pc++;
@@ -762,11 +3294,23 @@ static int VM_PrepareInterpreter(vm_t* vm, const vmHeader_t* header)
         case OP_GTF:
         case OP_GEF:
         case OP_BLOCK_COPY:
+            if (byte_pc + 4 > header->codeLength)
+            {
+                Com_Error(vm->lastError = VM_PC_OUT_OF_RANGE,
+                          "VM_PrepareInterpreter: pc > header->codeLength");
+                return -1;
+            }
             codeBase[int_pc] = LittleEndianToHost(&code[byte_pc]);
             byte_pc += 4;
             int_pc++;
             break;
         case OP_ARG:
+            if (byte_pc >= header->codeLength)
+            {
+                Com_Error(vm->lastError = VM_PC_OUT_OF_RANGE,
+                          "VM_PrepareInterpreter: pc > header->codeLength");
+                return -1;
+            }
             codeBase[int_pc] = (int)code[byte_pc];
             byte_pc++;
             int_pc++;
@@ -781,6 +3325,11 @@ static int VM_PrepareInterpreter(vm_t* vm, const vmHeader_t* header)
             break;
         }
     }
+    /* the expanded code is shorter than codeLength words: pad with
+       OP_UNDEF */
+    Com_Memset(&codeBase[int_pc], 0, (vm->codeLength - int_pc) * sizeof(int));
+    vm->verified = VM_VerifyCode(vm);
+
     int_pc      = 0;
     instruction = 0;
 
@@ -813,7 +3362,8 @@ static int VM_PrepareInterpreter(vm_t* vm, const vmHeader_t* header)
         case OP_LEF:
         case OP_GTF:
         case OP_GEF:
-            if (codeBase[int_pc] < 0 || codeBase[int_pc] > vm->instructionCount)
+            if (codeBase[int_pc] < 0 ||
+                codeBase[int_pc] >= vm->instructionCount)
             {
                 Com_Error(vm->lastError = VM_JUMP_TO_INVALID_INSTRUCTION,
                           "VM_PrepareInterpreter: Jump to invalid "
@@ -842,9 +3392,311 @@ static int VM_PrepareInterpreter(vm_t* vm, const vmHeader_t* header)
             break;
         }
     }
+
+    VM_FuseInstructions(vm);
+
+#ifdef USE_DIRECT_THREADING
+    vm->threadedCode = (intptr_t*)VM_PoolAlloc(
+        vm->codeLength * sizeof(*vm->threadedCode), vm, VM_ALLOC_CODE_SEC);
+    if (!vm->threadedCode)
+    {
+        Com_Error(vm->lastError = VM_MALLOC_FAILED,
+                  "Code image malloc failed: out of memory?");
+        return -1;
+    }
+    VM_CallInterpreted(vm, 0, 0, NULL, 0, NULL); /* fill vm->threadedCode */
+#endif
+
     return 0;
 }
 
+static void VM_FuseInstructions(vm_t* vm)
+{
+    int* codeBase = (int*)vm->codeBase;
+    int  instruction;
+    int  pc;
+    int  op;
+    int  next;
+    int  next2;
+
+    vm->fusionCount = 0;
+    for (instruction = 0; instruction < vm->instructionCount - 1;
+         instruction++)
+    {
+        pc    = vm->instructionPointers[instruction];
+        op    = codeBase[pc];
+        next  = codeBase[vm->instructionPointers[instruction + 1]];
+        next2 = (instruction + 2 < vm->instructionCount)
+                    ? codeBase[vm->instructionPointers[instruction + 2]]
+                    : OP_UNDEF;
+
+        if (op == OP_LOCAL && next == OP_LOAD4)
+        {
+            codeBase[pc] = OP_LOCAL_LOAD4;
+        }
+        else if (op == OP_LOCAL && next == OP_CONST && next2 == OP_STORE4)
+        {
+            codeBase[pc] = OP_LOCAL_CONST_STORE4;
+        }
+        else if (op == OP_CONST && next == OP_ADD)
+        {
+            codeBase[pc] = OP_CONST_ADD;
+        }
+        else if (op == OP_CONST && next == OP_JUMP)
+        {
+            /* the target is checked here, so the fused op doesn't have to */
+            if (codeBase[pc + 1] < 0 ||
+                codeBase[pc + 1] >= vm->instructionCount)
+            {
+                continue;
+            }
+            codeBase[pc] = OP_CONST_JUMP;
+        }
+        else if (op == OP_CONST && next >= OP_EQ && next <= OP_GEU)
+        {
+            codeBase[pc] = OP_CONST_EQ + (next - OP_EQ);
+        }
+        else if (op == OP_CONST && next == OP_CALL && vm->verified &&
+                 codeBase[pc + 1] >= 0)
+        {
+            /* VM_VerifyCode proved that the target is a function */
+            codeBase[pc] = OP_CONST_CALL;
+        }
+        else
+        {
+            continue;
+        }
+        vm->fusionCount++;
+    }
+}
+
+/** Helper for VM_VerifyCode: set the op stack depth of an instruction.
+ * @param[in,out] depth Op stack depth for every instruction, -1 if unknown.
+ * @param[in] instruction Index of the instruction.
+ * @param[in] d Op stack depth before the instruction is executed.
+ * @param[in,out] changed Set to 1 if a new depth was recorded.
+ * @return 0 if OK, -1 if the instruction has a different depth. */
+static int VM_VerifyDepth(int* depth, int instruction, int d, int* changed)
+{
+    if (depth[instruction] < 0)
+    {
+        depth[instruction] = d;
+        *changed           = 1;
+        return 0;
+    }
+    return (depth[instruction] == d) ? 0 : -1;
+}
+
+static int VM_VerifyCode(const vm_t* vm)
+{
+    const int* codeBase = (const int*)vm->codeBase;
+    const int  count    = vm->instructionCount;
+    int*       depth; /* op stack depth before every instruction */
+    int*       func;  /* index of the OP_ENTER of every instruction */
+    int        instruction;
+    int        op;
+    int        operand;
+    int        d;
+    int        pops;
+    int        pushes;
+    int        changed;
+    int        frame = 0;
+    int        ok    = 1;
+
+    if (count < 1 || codeBase[vm->instructionPointers[0]] != OP_ENTER)
+    {
+        return 0;
+    }
+    depth = (int*)Com_malloc(2 * count * sizeof(int), (vm_t*)vm,
+                             VM_ALLOC_INSTRUCTION_POINTERS);
+    if (!depth)
+    {
+        return 0; /* not fatal, the interpreter keeps its runtime checks */
+    }
+    func = depth + count;
+
+    /* functions and frames */
+    for (instruction = 0; instruction < count && ok; instruction++)
+    {
+        /* only read the operand of op codes that have one: the last
+           instruction can end the code */
+        op = codeBase[vm->instructionPointers[instruction]];
+        if (op == OP_ENTER)
+        {
+            frame = codeBase[vm->instructionPointers[instruction] + 1];
+            func[instruction] = instruction;
+            depth[instruction] = 0;
+            if (frame < 8 || (frame & 3) || frame >= vm->stackSize)
+            {
+                ok = 0;
+            }
+            continue;
+        }
+        func[instruction]  = func[instruction - 1];
+        depth[instruction] = -1;
+        if (op == OP_LEAVE &&
+            codeBase[vm->instructionPointers[instruction] + 1] != frame)
+        {
+            ok = 0;
+        }
+    }
+
+    /* Propagate the op stack depths until nothing changes. Targets of
+       computed jumps (switch tables) are not known, these instructions
+       are assumed to start with an empty op stack, like every statement. */
+    changed = 1;
+    while (ok && changed)
+    {
+        changed = 0;
+        for (instruction = 0; instruction < count && ok; instruction++)
+        {
+            d = depth[instruction];
+            if (d < 0)
+            {
+                continue;
+            }
+            op     = codeBase[vm->instructionPointers[instruction]];
+            pops   = 0;
+            pushes = 0;
+            switch (op)
+            {
+            case OP_IGNORE:
+            case OP_BREAK:
+            case OP_ENTER:
+                break;
+            case OP_PUSH:
+            case OP_CONST:
+            case OP_LOCAL:
+                pushes = 1;
+                break;
+            case OP_POP:
+            case OP_ARG:
+                pops = 1;
+                break;
+            case OP_CALL:
+                if (instruction > 0 &&
+                    codeBase[vm->instructionPointers[instruction - 1]] ==
+                        OP_CONST)
+                {
+                    operand =
+                        codeBase[vm->instructionPointers[instruction - 1] + 1];
+                    if (operand >= count ||
+                        (operand >= 0 &&
+                         codeBase[vm->instructionPointers[operand]] !=
+                             OP_ENTER))
+                    {
+                        ok = 0;
+                    }
+                }
+                pops   = 1;
+                pushes = 1;
+                break;
+            case OP_LOAD1:
+            case OP_LOAD2:
+            case OP_LOAD4:
+            case OP_SEX8:
+            case OP_SEX16:
+            case OP_NEGI:
+            case OP_BCOM:
+            case OP_NEGF:
+            case OP_CVIF:
+            case OP_CVFI:
+                pops   = 1;
+                pushes = 1;
+                break;
+            case OP_STORE1:
+            case OP_STORE2:
+            case OP_STORE4:
+            case OP_BLOCK_COPY:
+                pops = 2;
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_DIVI:
+            case OP_DIVU:
+            case OP_MODI:
+            case OP_MODU:
+            case OP_MULI:
+            case OP_MULU:
+            case OP_BAND:
+            case OP_BOR:
+            case OP_BXOR:
+            case OP_LSH:
+            case OP_RSHI:
+            case OP_RSHU:
+            case OP_ADDF:
+            case OP_SUBF:
+            case OP_DIVF:
+            case OP_MULF:
+                pops   = 2;
+                pushes = 1;
+                break;
+            case OP_LEAVE:
+                /* exactly the return value must be left */
+                ok = (d == 1);
+                continue;
+            case OP_JUMP:
+                ok = (d == 1);
+                if (ok && instruction > 0 &&
+                    codeBase[vm->instructionPointers[instruction - 1]] ==
+                        OP_CONST)
+                {
+                    operand =
+                        codeBase[vm->instructionPointers[instruction - 1] + 1];
+                    ok = (operand >= 0 && operand < count &&
+                          func[operand] == func[instruction] &&
+                          VM_VerifyDepth(depth, operand, 0, &changed) == 0);
+                }
+                continue;
+            default:
+                if (op >= OP_EQ && op <= OP_GEF)
+                {
+                    operand =
+                        codeBase[vm->instructionPointers[instruction] + 1];
+                    ok = (d >= 2 && operand >= 0 && operand < count &&
+                          func[operand] == func[instruction] &&
+                          VM_VerifyDepth(depth, operand, d - 2, &changed) ==
+                              0);
+                    pops = 2;
+                    break;
+                }
+                ok = 0; /* OP_UNDEF */
+                continue;
+            }
+            d = d - pops + pushes;
+            if (d - pushes < 0 || d >= OPSTACK_SIZE / (int)sizeof(int) - 1)
+            {
+                ok = 0; /* op stack underflow or overflow */
+            }
+            else if (instruction + 1 >= count ||
+                     func[instruction + 1] != func[instruction])
+            {
+                ok = 0; /* falls through to the next function */
+            }
+            else if (VM_VerifyDepth(depth, instruction + 1, d, &changed) != 0)
+            {
+                ok = 0;
+            }
+        }
+        if (ok && !changed)
+        {
+            /* seed the first instruction not reached so far */
+            for (instruction = 0; instruction < count; instruction++)
+            {
+                if (depth[instruction] < 0)
+                {
+                    depth[instruction] = 0;
+                    changed            = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    Com_free(depth, (vm_t*)vm, VM_ALLOC_INSTRUCTION_POINTERS);
+    return ok;
+}
+
 /*
 ==============
 VM_CallInterpreted
@@ -868,7 +3720,8 @@ locals from sp
 ==============
 */
 
-static int VM_CallInterpreted(vm_t* vm, int* args)
+static int VM_CallInterpreted(vm_t* vm, int function, int argc,
+                              const int* args, int count, intptr_t* results)
 {
     uint8_t  stack[OPSTACK_SIZE + 15];
     int*     opStack;
@@ -877,12 +3730,100 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
     int      programStack;
     int      stackOnEntry;
     uint8_t* image;
+#ifdef USE_DIRECT_THREADING
+    intptr_t* codeImage;
+#else
     int*     codeImage;
+#endif
     int      v1;
     int      dataMask;
+#ifdef USE_BOUNDS_CHECK
+    unsigned int dataLength;
+#endif
     int      arg;
+    int      call;
+    int      budgeted;
+    int      r0; /* top of the op stack */
+    int      r1; /* item below the top */
+#ifndef USE_DIRECT_THREADING
+    int      opcode;
+#endif
 #ifdef DEBUG_VM
     vmSymbol_t* profileSymbol;
+    char        symbolText[MAX_TOKEN_CHARS];
+#endif
+#ifdef USE_COMPUTED_GOTOS
+    static const void* dispatch_table[OPCODE_TABLE_SIZE] = {
+        &&goto_OP_UNDEF,  &&goto_OP_IGNORE,     &&goto_OP_BREAK,
+        &&goto_OP_ENTER,  &&goto_OP_LEAVE,      &&goto_OP_CALL,
+        &&goto_OP_PUSH,   &&goto_OP_POP,        &&goto_OP_CONST,
+        &&goto_OP_LOCAL,  &&goto_OP_JUMP,       &&goto_OP_EQ,
+        &&goto_OP_NE,     &&goto_OP_LTI,        &&goto_OP_LEI,
+        &&goto_OP_GTI,    &&goto_OP_GEI,        &&goto_OP_LTU,
+        &&goto_OP_LEU,    &&goto_OP_GTU,        &&goto_OP_GEU,
+        &&goto_OP_EQF,    &&goto_OP_NEF,        &&goto_OP_LTF,
+        &&goto_OP_LEF,    &&goto_OP_GTF,        &&goto_OP_GEF,
+        &&goto_OP_LOAD1,  &&goto_OP_LOAD2,      &&goto_OP_LOAD4,
+        &&goto_OP_STORE1, &&goto_OP_STORE2,     &&goto_OP_STORE4,
+        &&goto_OP_ARG,    &&goto_OP_BLOCK_COPY, &&goto_OP_SEX8,
+        &&goto_OP_SEX16,  &&goto_OP_NEGI,       &&goto_OP_ADD,
+        &&goto_OP_SUB,    &&goto_OP_DIVI,       &&goto_OP_DIVU,
+        &&goto_OP_MODI,   &&goto_OP_MODU,       &&goto_OP_MULI,
+        &&goto_OP_MULU,   &&goto_OP_BAND,       &&goto_OP_BOR,
+        &&goto_OP_BXOR,   &&goto_OP_BCOM,       &&goto_OP_LSH,
+        &&goto_OP_RSHI,   &&goto_OP_RSHU,       &&goto_OP_NEGF,
+        &&goto_OP_ADDF,   &&goto_OP_SUBF,       &&goto_OP_DIVF,
+        &&goto_OP_MULF,   &&goto_OP_CVIF,       &&goto_OP_CVFI,
+        /* superinstructions */
+        &&goto_OP_LOCAL_LOAD4, &&goto_OP_LOCAL_CONST_STORE4,
+        &&goto_OP_CONST_ADD,   &&goto_OP_CONST_JUMP,
+        &&goto_OP_CONST_EQ,    &&goto_OP_CONST_NE,
+        &&goto_OP_CONST_LTI,   &&goto_OP_CONST_LEI,
+        &&goto_OP_CONST_GTI,   &&goto_OP_CONST_GEI,
+        &&goto_OP_CONST_LTU,   &&goto_OP_CONST_LEU,
+        &&goto_OP_CONST_GTU,   &&goto_OP_CONST_GEU,
+        &&goto_OP_CONST_CALL,
+        &&goto_OP_PROFILE, &&goto_OP_BUDGET,
+        /* Invalid OP CODES for opcode_table_mask */
+        &&goto_OP_UNDEF,
+        &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF,
+        &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF,
+        &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF,
+        &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF,
+        &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF,
+        &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF,
+        &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF,
+        &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF,
+        &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF,
+        &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF,
+        &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF,
+        &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF, &&goto_OP_UNDEF,
+        &&goto_OP_UNDEF, &&goto_OP_UNDEF,
+    };
+#endif
+
+#ifdef USE_DIRECT_THREADING
+    if (count == 0)
+    {
+        /* called by VM_PrepareInterpreter: replace the op codes with the
+           addresses of the handlers, copy the operands */
+        const int* code = (const int*)vm->codeBase;
+        int        i;
+
+        for (i = 0; i < vm->codeLength; i++)
+        {
+            vm->threadedCode[i] = code[i];
+        }
+        for (i = 0; i < vm->instructionCount; i++)
+        {
+            programCounter = vm->instructionPointers[i];
+            vm->threadedCode[programCounter] = (intptr_t)
+                dispatch_table[code[programCounter] & OPCODE_TABLE_MASK];
+        }
+        vm_profileHandler = (intptr_t)dispatch_table[OP_PROFILE];
+        vm_budgetHandler  = (intptr_t)dispatch_table[OP_BUDGET];
+        return 0;
+    }
 #endif
 
     /* interpret the code */
@@ -892,20 +3833,68 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
     programStack = stackOnEntry = vm->programStack;
 
 #ifdef DEBUG_VM
-    profileSymbol = VM_ValueToFunctionSymbol(vm, 0);
+    profileSymbol =
+        VM_ValueToFunctionSymbol(vm, vm->instructionPointers[function]);
     /* uncomment this for debugging breakpoints */
     vm->breakFunction = 0;
 #endif
 
-    image          = vm->dataBase;
-    codeImage      = (int*)vm->codeBase;
-    dataMask       = vm->dataMask;
-    programCounter = 0;
-    programStack -= (8 + 4 * MAX_VMMAIN_ARGS);
+    image    = vm->dataBase;
+    dataMask = vm->dataMask;
+#ifdef USE_BOUNDS_CHECK
+    dataLength = vm->dataLength;
+#endif
+#ifdef USE_DIRECT_THREADING
+    codeImage = vm->threadedCode;
+#else
+    codeImage = (int*)vm->codeBase;
+#endif
+    /* only the call from the host checks the budget, see VM_SetBudget */
+    budgeted = vm->budget && vm->budget->armed;
+    if (budgeted)
+    {
+        vm->budget->armed = 0;
+        vm->budget->left  = vm->budget->limit;
+        codeImage         = vm->budget->code;
+    }
+    if (vm->profiling)
+    {
+        codeImage                = vm->profiler->code;
+        vm->profiler->lastOpcode = -1; /* no pair with the caller's op */
+        if (vm->callLevel == 1 && !vm->suspended && vm->profiler->depth)
+        {
+            /* an aborted call left its functions on the stack */
+            vm->profiler->depth = 0;
+            Com_Memset(vm->profiler->active, 0,
+                       vm->profiler->results.numFunctions * sizeof(int));
+        }
+    }
+    call = 0;
+
+    opStack = PADP(stack, 16);
+    if (vm->suspended)
+    {
+        /* VM_Resume: continue at the budget point that suspended the call */
+        vm->suspended  = 0;
+        programCounter = vm->budget->programCounter;
+        programStack   = vm->budget->programStack;
+        opStackOfs     = (uint8_t)vm->budget->opStackOfs;
+        Com_Memcpy(opStack, vm->budget->opStack,
+                   (opStackOfs + 1) * sizeof(int));
+#ifdef DEBUG_VM
+        profileSymbol = VM_ValueToFunctionSymbol(vm, programCounter);
+#endif
+        goto resume;
+    }
+
+nextCall: /* a batch of calls starts every call here */
+    programCounter = vm->instructionPointers[function];
+    /* reserve the frame for all arguments, but only copy the passed ones */
+    programStack = stackOnEntry - (8 + 4 * MAX_VMMAIN_ARGS);
 
-    for (arg = 0; arg < MAX_VMMAIN_ARGS; arg++)
+    for (arg = 0; arg < argc; arg++)
     {
-        *(int*)&image[programStack + 8 + arg * 4] = args[arg];
+        *(int*)&image[programStack + 8 + arg * 4] = args[call * argc + arg];
     }
 
     *(int*)&image[programStack + 4] = 0; /* return stack */
@@ -918,50 +3907,38 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
     *opStack   = 0x0000BEEF;
     opStackOfs = 0;
 
+resume:
     /* main interpreter loop, will exit when a LEAVE instruction
        grabs the -1 program counter */
 
-    int opcode, r0, r1;
-#define r2 codeImage[programCounter]
+    /* The top of the op stack is only kept in r0, opStack[opStackOfs] is
+       not up to date. Every push spills r0 to opStack[opStackOfs] first,
+       DISPATCH() reloads r0 after a pop, DISPATCH2() keeps r0.
+       r1 is the item below the top, loaded on demand. */
+#define r2 ((int)codeImage[programCounter])
 
-#ifdef USE_COMPUTED_GOTOS
-    static const void* dispatch_table[OPCODE_TABLE_SIZE] = {
-        &&goto_OP_UNDEF,  &&goto_OP_IGNORE,     &&goto_OP_BREAK,
-        &&goto_OP_ENTER,  &&goto_OP_LEAVE,      &&goto_OP_CALL,
-        &&goto_OP_PUSH,   &&goto_OP_POP,        &&goto_OP_CONST,
-        &&goto_OP_LOCAL,  &&goto_OP_JUMP,       &&goto_OP_EQ,
-        &&goto_OP_NE,     &&goto_OP_LTI,        &&goto_OP_LEI,
-        &&goto_OP_GTI,    &&goto_OP_GEI,        &&goto_OP_LTU,
-        &&goto_OP_LEU,    &&goto_OP_GTU,        &&goto_OP_GEU,
-        &&goto_OP_EQF,    &&goto_OP_NEF,        &&goto_OP_LTF,
-        &&goto_OP_LEF,    &&goto_OP_GTF,        &&goto_OP_GEF,
-        &&goto_OP_LOAD1,  &&goto_OP_LOAD2,      &&goto_OP_LOAD4,
-        &&goto_OP_STORE1, &&goto_OP_STORE2,     &&goto_OP_STORE4,
-        &&goto_OP_ARG,    &&goto_OP_BLOCK_COPY, &&goto_OP_SEX8,
-        &&goto_OP_SEX16,  &&goto_OP_NEGI,       &&goto_OP_ADD,
-        &&goto_OP_SUB,    &&goto_OP_DIVI,       &&goto_OP_DIVU,
-        &&goto_OP_MODI,   &&goto_OP_MODU,       &&goto_OP_MULI,
-        &&goto_OP_MULU,   &&goto_OP_BAND,       &&goto_OP_BOR,
-        &&goto_OP_BXOR,   &&goto_OP_BCOM,       &&goto_OP_LSH,
-        &&goto_OP_RSHI,   &&goto_OP_RSHU,       &&goto_OP_NEGF,
-        &&goto_OP_ADDF,   &&goto_OP_SUBF,       &&goto_OP_DIVF,
-        &&goto_OP_MULF,   &&goto_OP_CVIF,       &&goto_OP_CVFI,
-        &&goto_OP_UNDEF, /* Invalid OP CODE for opcode_table_mask */
-        &&goto_OP_UNDEF, /* Invalid OP CODE for opcode_table_mask */
-        &&goto_OP_UNDEF, /* Invalid OP CODE for opcode_table_mask */
-        &&goto_OP_UNDEF, /* Invalid OP CODE for opcode_table_mask */
-    };
+#if defined(USE_DIRECT_THREADING)
+#define DISPATCH2() goto*(void*)codeImage[programCounter++]
+#elif defined(USE_COMPUTED_GOTOS)
 #define DISPATCH2()                                                            \
     opcode = codeImage[programCounter++];                                      \
     goto* dispatch_table[opcode & OPCODE_TABLE_MASK]
+#endif
+#ifdef USE_COMPUTED_GOTOS
 #define DISPATCH()                                                             \
     r0 = opStack[opStackOfs];                                                  \
-    r1 = opStack[(uint8_t)(opStackOfs - 1)];                                   \
     DISPATCH2()
     DISPATCH(); /* initial jump into the loop */
 #else
 #define DISPATCH2() goto nextInstruction2
 #define DISPATCH() goto nextInstruction
+#endif
+#ifdef USE_BOUNDS_CHECK
+#define CHECK_DATA(addr)                                                       \
+    if ((unsigned int)(addr) >= dataLength)                                    \
+    goto dataOutOfRange
+#else
+#define CHECK_DATA(addr)
 #endif
 
     while (1)
@@ -969,7 +3946,6 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
 #ifndef USE_COMPUTED_GOTOS
     nextInstruction:
         r0 = opStack[opStackOfs];
-        r1 = opStack[(uint8_t)(opStackOfs - 1)];
     nextInstruction2:
         opcode = codeImage[programCounter++];
 
@@ -1000,8 +3976,12 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
             Com_Printf("%s%i %s\n", VM_Indent(vm), opStackOfs,
                        opnames[opcode & OPCODE_TABLE_MASK]);
         }
-        profileSymbol->profileCount++;
+        if (profileSymbol)
+        {
+            profileSymbol->profileCount++;
+        }
 #endif /* DEBUG_VM */
+    profileDispatch:
         switch (opcode)
 #endif /* !USE_COMPUTED_GOTOS */
         {
@@ -1018,57 +3998,68 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
             vm->breakCount++;
             DISPATCH2();
         goto_OP_CONST:
+            opStack[opStackOfs] = r0;
             opStackOfs++;
-            r1 = r0;
-            r0 = opStack[opStackOfs] = r2;
+            r0 = r2;
 
             programCounter += 1;
             DISPATCH2();
         goto_OP_LOCAL:
+            opStack[opStackOfs] = r0;
             opStackOfs++;
-            r1 = r0;
-            r0 = opStack[opStackOfs] = r2 + programStack;
+            r0 = r2 + programStack;
 
             programCounter += 1;
             DISPATCH2();
         goto_OP_LOAD4:
 #ifdef DEBUG_VM
-            if (opStack[opStackOfs] & 3)
+            if (r0 & 3)
             {
                 vm->lastError = VM_OP_LOAD4_MISALIGNED;
                 Com_Error(vm->lastError, "OP_LOAD4 misaligned");
                 return -1;
             }
 #endif
-            r0 = opStack[opStackOfs] = *(int*)&image[r0 & dataMask];
+            CHECK_DATA(r0);
+            r0 = *(int*)&image[VM_DATA_INDEX(r0, dataMask)];
             DISPATCH2();
         goto_OP_LOAD2:
-            r0 = opStack[opStackOfs] = *(unsigned short*)&image[r0 & dataMask];
+            CHECK_DATA(r0);
+            r0 = *(unsigned short*)&image[VM_DATA_INDEX(r0, dataMask)];
             DISPATCH2();
         goto_OP_LOAD1:
-            r0 = opStack[opStackOfs] = image[r0 & dataMask];
+            CHECK_DATA(r0);
+            r0 = image[VM_DATA_INDEX(r0, dataMask)];
             DISPATCH2();
 
         goto_OP_STORE4:
-            *(int*)&image[r1 & dataMask] = r0;
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
+            CHECK_DATA(r1);
+            *(int*)&image[VM_DATA_INDEX(r1, dataMask)] = r0;
             opStackOfs -= 2;
             DISPATCH();
         goto_OP_STORE2:
-            *(short*)&image[r1 & dataMask] = r0;
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
+            CHECK_DATA(r1);
+            *(short*)&image[VM_DATA_INDEX(r1, dataMask)] = r0;
             opStackOfs -= 2;
             DISPATCH();
         goto_OP_STORE1:
-            image[r1 & dataMask] = r0;
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
+            CHECK_DATA(r1);
+            image[VM_DATA_INDEX(r1, dataMask)] = r0;
             opStackOfs -= 2;
             DISPATCH();
         goto_OP_ARG:
             /* single byte offset from programStack */
-            *(int*)&image[(codeImage[programCounter] + programStack) &
-                          dataMask] = r0;
+            CHECK_DATA(codeImage[programCounter] + programStack);
+            *(int*)&image[VM_DATA_INDEX(
+                codeImage[programCounter] + programStack, dataMask)] = r0;
             opStackOfs--;
             programCounter += 1;
             DISPATCH();
         goto_OP_BLOCK_COPY:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             VM_BlockCopy(r1, r0, r2, vm);
             programCounter += 1;
             opStackOfs -= 2;
@@ -1097,23 +4088,7 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
 #endif
                 *(int*)&image[programStack + 4] = -1 - programCounter;
 
-                /* the vm has ints on the stack, we expect
-                   pointers so we might have to convert it */
-                if (sizeof(intptr_t) != sizeof(int))
-                {
-                    intptr_t argarr[MAX_VMSYSCALL_ARGS];
-                    int*     imagePtr = (int*)&image[programStack];
-                    int      i;
-                    for (i = 0; i < (int)ARRAY_LEN(argarr); ++i)
-                    {
-                        argarr[i] = *(++imagePtr);
-                    }
-                    r = vm->systemCall(vm, argarr);
-                }
-                else
-                {
-                    r = vm->systemCall(vm, (intptr_t*)&image[programStack + 4]);
-                }
+                r = VM_SystemCall(vm, programStack);
 
 #ifdef DEBUG_VM
                 /* this is just our stack frame pointer, only needed
@@ -1129,7 +4104,8 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 if (vm_debugLevel)
                 {
                     Com_Printf("%s%i<--- %s\n", VM_Indent(vm), opStackOfs,
-                               VM_ValueToSymbol(vm, programCounter));
+                               VM_ValueToSymbol(vm, programCounter, symbolText,
+                                                sizeof(symbolText)));
                 }
 #endif
             }
@@ -1148,8 +4124,9 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
         /* push and pop are only needed for discarded or bad function return
            values */
         goto_OP_PUSH:
+            opStack[opStackOfs] = r0;
             opStackOfs++;
-            DISPATCH();
+            DISPATCH2();
         goto_OP_POP:
             opStackOfs--;
             DISPATCH();
@@ -1166,7 +4143,8 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
             if (vm_debugLevel)
             {
                 Com_Printf("%s%i---> %s\n", VM_Indent(vm), opStackOfs,
-                           VM_ValueToSymbol(vm, programCounter - 5));
+                           VM_ValueToSymbol(vm, programCounter - 5,
+                                            symbolText, sizeof(symbolText)));
                 if (vm->breakFunction &&
                     programCounter - 5 == vm->breakFunction)
                 {
@@ -1177,7 +4155,7 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 }
             }
 #endif
-            DISPATCH();
+            DISPATCH2();
         goto_OP_LEAVE:
             /* remove our stack frame */
             v1 = r2;
@@ -1191,7 +4169,8 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
             if (vm_debugLevel)
             {
                 Com_Printf("%s%i<--- %s\n", VM_Indent(vm), opStackOfs,
-                           VM_ValueToSymbol(vm, programCounter));
+                           VM_ValueToSymbol(vm, programCounter, symbolText,
+                                            sizeof(symbolText)));
             }
 #endif
             /* check for leaving the VM */
@@ -1205,7 +4184,7 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                           "VM program counter out of range in OP_LEAVE");
                 return -1;
             }
-            DISPATCH();
+            DISPATCH2();
 
         /*
            ===================================================================
@@ -1226,6 +4205,7 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
             opStackOfs--;
             DISPATCH();
         goto_OP_EQ:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
             if (r1 == r0)
             {
@@ -1238,6 +4218,7 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_NE:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
             if (r1 != r0)
             {
@@ -1250,6 +4231,7 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_LTI:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
             if (r1 < r0)
             {
@@ -1262,6 +4244,7 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_LEI:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
             if (r1 <= r0)
             {
@@ -1274,6 +4257,7 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_GTI:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
             if (r1 > r0)
             {
@@ -1286,6 +4270,7 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_GEI:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
             if (r1 >= r0)
             {
@@ -1298,6 +4283,7 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_LTU:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
             if (((unsigned)r1) < ((unsigned)r0))
             {
@@ -1310,6 +4296,7 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_LEU:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
             if (((unsigned)r1) <= ((unsigned)r0))
             {
@@ -1322,6 +4309,7 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_GTU:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
             if (((unsigned)r1) > ((unsigned)r0))
             {
@@ -1334,6 +4322,7 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_GEU:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
             if (((unsigned)r1) >= ((unsigned)r0))
             {
@@ -1346,10 +4335,10 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_EQF:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
 
-            if (((float*)opStack)[(uint8_t)(opStackOfs + 1)] ==
-                ((float*)opStack)[(uint8_t)(opStackOfs + 2)])
+            if (VM_IntToFloat(r1) == VM_IntToFloat(r0))
             {
                 programCounter = r2; /* vm->instructionPointers[r2]; */
                 DISPATCH();
@@ -1360,10 +4349,10 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_NEF:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
 
-            if (((float*)opStack)[(uint8_t)(opStackOfs + 1)] !=
-                ((float*)opStack)[(uint8_t)(opStackOfs + 2)])
+            if (VM_IntToFloat(r1) != VM_IntToFloat(r0))
             {
                 programCounter = r2; /* vm->instructionPointers[r2]; */
                 DISPATCH();
@@ -1374,10 +4363,10 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_LTF:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
 
-            if (((float*)opStack)[(uint8_t)(opStackOfs + 1)] <
-                ((float*)opStack)[(uint8_t)(opStackOfs + 2)])
+            if (VM_IntToFloat(r1) < VM_IntToFloat(r0))
             {
                 programCounter = r2; /* vm->instructionPointers[r2]; */
                 DISPATCH();
@@ -1388,10 +4377,10 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_LEF:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
 
-            if (((float*)opStack)[(uint8_t)((uint8_t)(opStackOfs + 1))] <=
-                ((float*)opStack)[(uint8_t)((uint8_t)(opStackOfs + 2))])
+            if (VM_IntToFloat(r1) <= VM_IntToFloat(r0))
             {
                 programCounter = r2; /* vm->instructionPointers[r2]; */
                 DISPATCH();
@@ -1402,10 +4391,10 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_GTF:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
 
-            if (((float*)opStack)[(uint8_t)(opStackOfs + 1)] >
-                ((float*)opStack)[(uint8_t)(opStackOfs + 2)])
+            if (VM_IntToFloat(r1) > VM_IntToFloat(r0))
             {
                 programCounter = r2; /* vm->instructionPointers[r2]; */
                 DISPATCH();
@@ -1416,10 +4405,10 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
                 DISPATCH();
             }
         goto_OP_GEF:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs -= 2;
 
-            if (((float*)opStack)[(uint8_t)(opStackOfs + 1)] >=
-                ((float*)opStack)[(uint8_t)(opStackOfs + 2)])
+            if (VM_IntToFloat(r1) >= VM_IntToFloat(r0))
             {
                 programCounter = r2; /* vm->instructionPointers[r2]; */
                 DISPATCH();
@@ -1433,215 +4422,1086 @@ static int VM_CallInterpreted(vm_t* vm, int* args)
         /*===================================================================*/
 
         goto_OP_NEGI:
-            opStack[opStackOfs] = -r0;
-            DISPATCH();
+            r0 = -r0;
+            DISPATCH2();
         goto_OP_ADD:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs--;
-            opStack[opStackOfs] = r1 + r0;
-            DISPATCH();
+            r0 = r1 + r0;
+            DISPATCH2();
         goto_OP_SUB:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs--;
-            opStack[opStackOfs] = r1 - r0;
-            DISPATCH();
+            r0 = r1 - r0;
+            DISPATCH2();
         goto_OP_DIVI:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs--;
-            opStack[opStackOfs] = r1 / r0;
-            DISPATCH();
+            r0 = r1 / r0;
+            DISPATCH2();
         goto_OP_DIVU:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs--;
-            opStack[opStackOfs] = ((unsigned)r1) / ((unsigned)r0);
-            DISPATCH();
+            r0 = ((unsigned)r1) / ((unsigned)r0);
+            DISPATCH2();
         goto_OP_MODI:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs--;
-            opStack[opStackOfs] = r1 % r0;
-            DISPATCH();
+            r0 = r1 % r0;
+            DISPATCH2();
         goto_OP_MODU:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs--;
-            opStack[opStackOfs] = ((unsigned)r1) % ((unsigned)r0);
-            DISPATCH();
+            r0 = ((unsigned)r1) % ((unsigned)r0);
+            DISPATCH2();
         goto_OP_MULI:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs--;
-            opStack[opStackOfs] = r1 * r0;
-            DISPATCH();
+            r0 = r1 * r0;
+            DISPATCH2();
         goto_OP_MULU:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
             opStackOfs--;
-            opStack[opStackOfs] = ((unsigned)r1) * ((unsigned)r0);
-            DISPATCH();
+            r0 = ((unsigned)r1) * ((unsigned)r0);
+            DISPATCH2();
         goto_OP_BAND:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
+            opStackOfs--;
+            r0 = ((unsigned)r1) & ((unsigned)r0);
+            DISPATCH2();
+        goto_OP_BOR:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
+            opStackOfs--;
+            r0 = ((unsigned)r1) | ((unsigned)r0);
+            DISPATCH2();
+        goto_OP_BXOR:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
+            opStackOfs--;
+            r0 = ((unsigned)r1) ^ ((unsigned)r0);
+            DISPATCH2();
+        goto_OP_BCOM:
+            r0 = ~((unsigned)r0);
+            DISPATCH2();
+        goto_OP_LSH:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
+            opStackOfs--;
+            r0 = r1 << r0;
+            DISPATCH2();
+        goto_OP_RSHI:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
+            opStackOfs--;
+            r0 = r1 >> r0;
+            DISPATCH2();
+        goto_OP_RSHU:
+            r1 = opStack[(uint8_t)(opStackOfs - 1)];
+            opStackOfs--;
+            r0 = ((unsigned)r1) >> r0;
+            DISPATCH2();
+        goto_OP_NEGF:
+            r0 = VM_FloatToInt(-VM_IntToFloat(r0));
+            DISPATCH2();
+        goto_OP_ADDF:
+            opStackOfs--;
+            r0 = VM_FloatToInt(VM_IntToFloat(opStack[opStackOfs]) +
+                               VM_IntToFloat(r0));
+            DISPATCH2();
+        goto_OP_SUBF:
+            opStackOfs--;
+            r0 = VM_FloatToInt(VM_IntToFloat(opStack[opStackOfs]) -
+                               VM_IntToFloat(r0));
+            DISPATCH2();
+        goto_OP_DIVF:
+            opStackOfs--;
+            r0 = VM_FloatToInt(VM_IntToFloat(opStack[opStackOfs]) /
+                               VM_IntToFloat(r0));
+            DISPATCH2();
+        goto_OP_MULF:
+            opStackOfs--;
+            r0 = VM_FloatToInt(VM_IntToFloat(opStack[opStackOfs]) *
+                               VM_IntToFloat(r0));
+            DISPATCH2();
+        goto_OP_CVIF:
+            r0 = VM_FloatToInt((float)r0);
+            DISPATCH2();
+        goto_OP_CVFI:
+            r0 = Q_ftol(VM_IntToFloat(r0));
+            DISPATCH2();
+        goto_OP_SEX8:
+            r0 = (int8_t)r0;
+            DISPATCH2();
+        goto_OP_SEX16:
+            r0 = (int16_t)r0;
+            DISPATCH2();
+
+        /*
+           ===================================================================
+           SUPERINSTRUCTIONS
+           The original op codes follow the fused op code in the code image,
+           r2 is the operand of the first op code of the sequence.
+           ===================================================================
+           */
+
+        goto_OP_LOCAL_LOAD4:
+#ifdef DEBUG_VM
+            if ((r2 + programStack) & 3)
+            {
+                vm->lastError = VM_OP_LOAD4_MISALIGNED;
+                Com_Error(vm->lastError, "OP_LOAD4 misaligned");
+                return -1;
+            }
+#endif
+            opStack[opStackOfs] = r0;
+            opStackOfs++;
+            CHECK_DATA(r2 + programStack);
+            r0 = *(int*)&image[VM_DATA_INDEX(r2 + programStack, dataMask)];
+
+            programCounter += 2;
+            DISPATCH2();
+        goto_OP_LOCAL_CONST_STORE4:
+            CHECK_DATA(r2 + programStack);
+            *(int*)&image[VM_DATA_INDEX(r2 + programStack, dataMask)] =
+                codeImage[programCounter + 2];
+
+            programCounter += 4;
+            DISPATCH2();
+        goto_OP_CONST_ADD:
+            r0 = r0 + r2;
+
+            programCounter += 2;
+            DISPATCH2();
+        goto_OP_CONST_JUMP:
+            /* jump target was checked by VM_FuseInstructions */
+            programCounter = vm->instructionPointers[r2];
+            DISPATCH2();
+        goto_OP_CONST_EQ:
             opStackOfs--;
-            opStack[opStackOfs] = ((unsigned)r1) & ((unsigned)r0);
+            programCounter = (r0 == r2) ? codeImage[programCounter + 2]
+                                        : programCounter + 3;
             DISPATCH();
-        goto_OP_BOR:
+        goto_OP_CONST_NE:
             opStackOfs--;
-            opStack[opStackOfs] = ((unsigned)r1) | ((unsigned)r0);
+            programCounter = (r0 != r2) ? codeImage[programCounter + 2]
+                                        : programCounter + 3;
             DISPATCH();
-        goto_OP_BXOR:
+        goto_OP_CONST_LTI:
             opStackOfs--;
-            opStack[opStackOfs] = ((unsigned)r1) ^ ((unsigned)r0);
-            DISPATCH();
-        goto_OP_BCOM:
-            opStack[opStackOfs] = ~((unsigned)r0);
+            programCounter = (r0 < r2) ? codeImage[programCounter + 2]
+                                       : programCounter + 3;
             DISPATCH();
-        goto_OP_LSH:
+        goto_OP_CONST_LEI:
             opStackOfs--;
-            opStack[opStackOfs] = r1 << r0;
+            programCounter = (r0 <= r2) ? codeImage[programCounter + 2]
+                                        : programCounter + 3;
             DISPATCH();
-        goto_OP_RSHI:
+        goto_OP_CONST_GTI:
             opStackOfs--;
-            opStack[opStackOfs] = r1 >> r0;
+            programCounter = (r0 > r2) ? codeImage[programCounter + 2]
+                                       : programCounter + 3;
             DISPATCH();
-        goto_OP_RSHU:
+        goto_OP_CONST_GEI:
             opStackOfs--;
-            opStack[opStackOfs] = ((unsigned)r1) >> r0;
-            DISPATCH();
-        goto_OP_NEGF:
-            ((float*)opStack)[opStackOfs] = -((float*)opStack)[opStackOfs];
+            programCounter = (r0 >= r2) ? codeImage[programCounter + 2]
+                                        : programCounter + 3;
             DISPATCH();
-        goto_OP_ADDF:
+        goto_OP_CONST_LTU:
             opStackOfs--;
-            ((float*)opStack)[opStackOfs] =
-                ((float*)opStack)[opStackOfs] +
-                ((float*)opStack)[(uint8_t)(opStackOfs + 1)];
+            programCounter = (((unsigned)r0) < ((unsigned)r2))
+                                 ? codeImage[programCounter + 2]
+                                 : programCounter + 3;
             DISPATCH();
-        goto_OP_SUBF:
+        goto_OP_CONST_LEU:
             opStackOfs--;
-            ((float*)opStack)[opStackOfs] =
-                ((float*)opStack)[opStackOfs] -
-                ((float*)opStack)[(uint8_t)(opStackOfs + 1)];
+            programCounter = (((unsigned)r0) <= ((unsigned)r2))
+                                 ? codeImage[programCounter + 2]
+                                 : programCounter + 3;
             DISPATCH();
-        goto_OP_DIVF:
+        goto_OP_CONST_GTU:
             opStackOfs--;
-            ((float*)opStack)[opStackOfs] =
-                ((float*)opStack)[opStackOfs] /
-                ((float*)opStack)[(uint8_t)(opStackOfs + 1)];
+            programCounter = (((unsigned)r0) > ((unsigned)r2))
+                                 ? codeImage[programCounter + 2]
+                                 : programCounter + 3;
             DISPATCH();
-        goto_OP_MULF:
+        goto_OP_CONST_GEU:
             opStackOfs--;
-            ((float*)opStack)[opStackOfs] =
-                ((float*)opStack)[opStackOfs] *
-                ((float*)opStack)[(uint8_t)(opStackOfs + 1)];
-            DISPATCH();
-        goto_OP_CVIF:
-            ((float*)opStack)[opStackOfs] = (float)opStack[opStackOfs];
-            DISPATCH();
-        goto_OP_CVFI:
-            opStack[opStackOfs] = Q_ftol(((float*)opStack)[opStackOfs]);
-            DISPATCH();
-        goto_OP_SEX8:
-            opStack[opStackOfs] = (int8_t)opStack[opStackOfs];
-            DISPATCH();
-        goto_OP_SEX16:
-            opStack[opStackOfs] = (int16_t)opStack[opStackOfs];
+            programCounter = (((unsigned)r0) >= ((unsigned)r2))
+                                 ? codeImage[programCounter + 2]
+                                 : programCounter + 3;
             DISPATCH();
+        goto_OP_CONST_CALL:
+            /* verified call: the target is the OP_ENTER of a function, no
+               range check required. Return after the OP_CALL. */
+            *(int*)&image[programStack] = programCounter + 2;
+            programCounter = vm->instructionPointers[r2];
+            DISPATCH2();
+        goto_OP_PROFILE:
+            /* the budget first: a suspended instruction runs again */
+            if (budgeted && vm->budget->point[programCounter - 1] &&
+                --vm->budget->left < 0)
+            {
+                goto suspend;
+            }
+            v1 = ((const int*)vm->codeBase)[programCounter - 1];
+            VM_ProfileInstruction(vm, v1, programCounter - 1, programStack);
+#ifdef USE_COMPUTED_GOTOS
+            goto* dispatch_table[v1 & OPCODE_TABLE_MASK];
+#else
+            opcode = v1;
+            goto profileDispatch;
+#endif
+        goto_OP_BUDGET:
+            if (--vm->budget->left >= 0)
+            {
+                v1 = ((const int*)vm->codeBase)[programCounter - 1];
+#ifdef USE_COMPUTED_GOTOS
+                goto* dispatch_table[v1 & OPCODE_TABLE_MASK];
+#else
+                opcode = v1;
+                goto profileDispatch;
+#endif
+            }
+        suspend:
+            /* used up: keep the state for VM_Resume and return */
+            opStack[opStackOfs]        = r0;
+            vm->budget->programCounter = programCounter - 1;
+            vm->budget->programStack   = programStack;
+            vm->budget->opStackOfs     = opStackOfs;
+            Com_Memcpy(vm->budget->opStack, opStack,
+                       (opStackOfs + 1) * sizeof(int));
+            vm->suspended             = 1;
+            vm->currentlyInterpreting = 0;
+            vm->programStack          = stackOnEntry;
+            return 0;
+#ifdef USE_BOUNDS_CHECK
+        dataOutOfRange:
+            vm->lastError = VM_DATA_OUT_OF_RANGE;
+            Com_Error(vm->lastError, "Memory access out of range");
+            vm->currentlyInterpreting = 0;
+            vm->programStack          = stackOnEntry;
+            return -1;
+#endif
         }
     }
 
 done:
-    vm->currentlyInterpreting = 0;
-
     if (opStackOfs != 1 || *opStack != 0x0000BEEF)
     {
         Com_Error(vm->lastError = VM_STACK_ERROR,
                   "Interpreter stack error");
     }
+    if (results)
+    {
+        results[call] = r0;
+    }
+    if (++call < count)
+    {
+        goto nextCall; /* keep the state of this activation */
+    }
 
-    vm->programStack = stackOnEntry;
+    vm->currentlyInterpreting = 0;
+    vm->programStack          = stackOnEntry;
 
     /* return the result of the bytecode computations */
-    return opStack[opStackOfs];
+    return r0;
 }
 
-/* DEBUG FUNCTIONS */
-/* --------------- */
+/* JIT COMPILER (x86-64) */
+/* --------------------- */
+
+#ifdef USE_JIT_X64
+/* Register usage of the generated code:
+ *   r12  dataBase          r13  vmJitContext_t*
+ *   r14  op stack base     r15d programStack
+ *   rbx  op stack index, only bl is modified so that it wraps around
+ *        like the uint8_t opStackOfs of the interpreter
+ *   rbp  saves the host stack pointer around calls to C functions
+ * The top of the op stack is [r14 + rbx*4], the item below is
+ * [r14 + rbx*4 - 4]. OP_CALL is a native call, OP_LEAVE a native ret. */
+
+/** Displacement for the top of the op stack */
+#define JIT_TOP 0
+/** Displacement for the item below the top of the op stack */
+#define JIT_NEXT -4
+/** No second opcode byte for VM_JitOpStack */
+#define JIT_NONE -1
+
+/** Append a byte to the native code. Only counts bytes in the first pass.
+ * @param[in,out] jit Code generator state.
+ * @param[in] b Byte to append. */
+static void VM_JitEmit1(vmJit_t* jit, int b)
+{
+    if (jit->buf)
+    {
+        jit->buf[jit->ofs] = (uint8_t)b;
+    }
+    jit->ofs++;
+}
 
-void VM_Debug(int level)
+/** Append a 32-bit little endian value to the native code.
+ * @param[in,out] jit Code generator state.
+ * @param[in] v Value to append. */
+static void VM_JitEmit4(vmJit_t* jit, int v)
 {
-    vm_debugLevel = level;
+    VM_JitEmit1(jit, v & 0xff);
+    VM_JitEmit1(jit, (v >> 8) & 0xff);
+    VM_JitEmit1(jit, (v >> 16) & 0xff);
+    VM_JitEmit1(jit, (v >> 24) & 0xff);
 }
 
-#ifdef DEBUG_VM
-static char* VM_Indent(vm_t* vm)
+/** Append a 64-bit little endian value to the native code.
+ * @param[in,out] jit Code generator state.
+ * @param[in] v Value to append. */
+static void VM_JitEmit8(vmJit_t* jit, intptr_t v)
 {
-    static char* string = "                                        ";
-    if (vm->callLevel > 20)
+    VM_JitEmit4(jit, (int)(v & 0xffffffff));
+    VM_JitEmit4(jit, (int)(v >> 32));
+}
+
+/** Append count bytes to the native code.
+ * @param[in,out] jit Code generator state.
+ * @param[in] count Number of bytes that follow. */
+static void VM_JitEmit(vmJit_t* jit, int count, ...)
+{
+    va_list ap;
+
+    va_start(ap, count);
+    while (count-- > 0)
     {
-        return string;
+        VM_JitEmit1(jit, va_arg(ap, int));
     }
-    return string + 2 * (20 - vm->callLevel);
+    va_end(ap);
 }
 
-static const char* VM_ValueToSymbol(vm_t* vm, int value)
+/** Append a 32-bit offset relative to the end of the offset to a location in
+ * the native code (operand for call, jmp and jcc).
+ * @param[in,out] jit Code generator state.
+ * @param[in] target Offset of the jump target in the native code. */
+static void VM_JitRel32(vmJit_t* jit, int target)
 {
-    vmSymbol_t* sym;
-    static char text[MAX_TOKEN_CHARS];
+    VM_JitEmit4(jit, target - (jit->ofs + 4));
+}
 
-    sym = vm->symbols;
-    if (!sym)
+/** Append an instruction that works on the op stack:
+ * [prefix] REX op1 [op2] ModRM SIB [disp8] with the memory operand
+ * [r14 + rbx*4 + disp].
+ * @param[in,out] jit Code generator state.
+ * @param[in] prefix Legacy prefix (0x66, 0xF3) or 0.
+ * @param[in] rex REX prefix, 0x41 or 0x49 (REX.B is required for r14).
+ * @param[in] op1 First opcode byte.
+ * @param[in] op2 Second opcode byte or JIT_NONE.
+ * @param[in] reg ModRM reg field: register or opcode extension.
+ * @param[in] disp JIT_TOP or JIT_NEXT. */
+static void VM_JitOpStack(vmJit_t* jit, int prefix, int rex, int op1, int op2,
+                          int reg, int disp)
+{
+    if (prefix)
     {
-        return "NO SYMBOLS";
+        VM_JitEmit1(jit, prefix);
+    }
+    VM_JitEmit1(jit, rex);
+    VM_JitEmit1(jit, op1);
+    if (op2 != JIT_NONE)
+    {
+        VM_JitEmit1(jit, op2);
+    }
+    if (disp)
+    {
+        VM_JitEmit1(jit, 0x44 | (reg << 3));
+        VM_JitEmit1(jit, 0x9E);
+        VM_JitEmit1(jit, disp & 0xff);
     }
+    else
+    {
+        VM_JitEmit1(jit, 0x04 | (reg << 3));
+        VM_JitEmit1(jit, 0x9E);
+    }
+}
+
+/** Append a call to a C function. The host stack is aligned to 16 bytes
+ * for the call, as the depth of the VM call stack is not known.
+ * @param[in,out] jit Code generator state.
+ * @param[in] func Address of the C function. */
+static void VM_JitCallC(vmJit_t* jit, intptr_t func)
+{
+    VM_JitEmit(jit, 3, 0x48, 0x89, 0xE5);       /* mov rbp, rsp */
+    VM_JitEmit(jit, 4, 0x48, 0x83, 0xE4, 0xF0); /* and rsp, -16 */
+    VM_JitEmit(jit, 2, 0x48, 0xB8);             /* mov rax, func */
+    VM_JitEmit8(jit, func);
+    VM_JitEmit(jit, 2, 0xFF, 0xD0);       /* call rax */
+    VM_JitEmit(jit, 3, 0x48, 0x89, 0xEC); /* mov rsp, rbp */
+}
+
+/** Called by the native code if the bytecode has to be aborted.
+ * @param[in,out] ctx Current JIT context.
+ * @param[in] error vmErrorCode_t */
+static void VM_JitError(vmJitContext_t* ctx, int error)
+{
+    const char* msg;
 
-    /* find the symbol */
-    while (sym->next && sym->next->symValue <= value)
+    switch (error)
     {
-        sym = sym->next;
+    case VM_PC_OUT_OF_RANGE:
+        msg = "VM program counter out of range";
+        break;
+    case VM_STACK_OVERFLOW:
+        msg = "VM stack overflow";
+        break;
+    case VM_DATA_OUT_OF_RANGE:
+        msg = "Memory access out of range";
+        break;
+    default:
+        msg = "Bad VM instruction";
+        break;
     }
+    ctx->error = error;
+    Com_Error(ctx->vm->lastError = (vmErrorCode_t)error, msg);
+}
 
-    if (value == sym->symValue)
+/** Called by the native code for OP_CALL with a negative target.
+ * @param[in,out] ctx Current JIT context.
+ * @param[in] target Negative OP_CALL target: -1 - syscall number.
+ * @param[in] programStack Current program stack.
+ * @return Return value of the host function. */
+static int VM_JitSystemCall(vmJitContext_t* ctx, int target, int programStack)
+{
+    vm_t* vm = ctx->vm;
+
+    /* save the stack to allow recursive VM entry */
+    vm->programStack = programStack - 4;
+    *(int*)&ctx->dataBase[(programStack + 4) & vm->dataMask] = -1 - target;
+
+    return (int)VM_SystemCall(vm, programStack);
+}
+
+/** Emit the entry point and the helper stubs used by the instructions.
+ * void entry(vmJitContext_t* ctx) calls the function at ctx->entry.
+ * @param[in] vm Current VM.
+ * @param[in,out] jit Code generator state. */
+static void VM_JitStubs(const vm_t* vm, vmJit_t* jit)
+{
+    /* entry: save callee-saved registers, keep the stack 16 byte aligned */
+    VM_JitEmit(jit, 10, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41,
+               0x57);                           /* push rbx, rbp, r12-r15 */
+    VM_JitEmit(jit, 4, 0x48, 0x83, 0xEC, 0x08); /* sub rsp, 8 */
+    VM_JitEmit(jit, 3, 0x49, 0x89, 0xFD);       /* mov r13, rdi */
+    VM_JitEmit(jit, 4, 0x4D, 0x8B, 0x65,
+               (int)offsetof(vmJitContext_t, dataBase)); /* mov r12, [r13] */
+    VM_JitEmit(jit, 4, 0x4D, 0x8B, 0x75,
+               (int)offsetof(vmJitContext_t, opStack)); /* mov r14, [r13] */
+    VM_JitEmit(jit, 4, 0x45, 0x8B, 0x7D,
+               (int)offsetof(vmJitContext_t, programStack)); /* mov r15d */
+    VM_JitEmit(jit, 4, 0x41, 0x8B, 0x5D,
+               (int)offsetof(vmJitContext_t, opStackOfs)); /* mov ebx */
+    VM_JitEmit(jit, 4, 0x49, 0x89, 0x65,
+               (int)offsetof(vmJitContext_t, savedStack)); /* mov [r13], rsp */
+    VM_JitEmit(jit, 4, 0x48, 0x8D, 0x84, 0x24); /* lea rax, [rsp - size] */
+    VM_JitEmit4(jit, -JIT_NATIVE_STACK_SIZE);
+    VM_JitEmit(jit, 4, 0x49, 0x89, 0x45,
+               (int)offsetof(vmJitContext_t, stackLimit)); /* mov [r13], rax */
+    VM_JitEmit(jit, 4, 0x41, 0xFF, 0x55,
+               (int)offsetof(vmJitContext_t, entry)); /* call [r13] */
+
+    /* epilogue: hand the state back to VM_CallCompiled */
+    jit->epilogue = jit->ofs;
+    VM_JitEmit(jit, 4, 0x41, 0x89, 0x5D,
+               (int)offsetof(vmJitContext_t, opStackOfs)); /* mov [r13], ebx */
+    VM_JitEmit(jit, 4, 0x45, 0x89, 0x7D,
+               (int)offsetof(vmJitContext_t, programStack)); /* mov [r13] */
+    VM_JitEmit(jit, 4, 0x48, 0x83, 0xC4, 0x08); /* add rsp, 8 */
+    VM_JitEmit(jit, 10, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D,
+               0x5B);    /* pop r15-r12, rbp, rbx */
+    VM_JitEmit1(jit, 0xC3); /* ret */
+
+    /* error: unwind the native call stack, esi holds the error code */
+    jit->error = jit->ofs;
+    VM_JitEmit(jit, 4, 0x49, 0x8B, 0x65,
+               (int)offsetof(vmJitContext_t, savedStack)); /* mov rsp, [r13] */
+    VM_JitEmit(jit, 3, 0x4C, 0x89, 0xEF);                  /* mov rdi, r13 */
+    VM_JitEmit(jit, 2, 0x48, 0xB8);                        /* mov rax, func */
+    VM_JitEmit8(jit, (intptr_t)VM_JitError);
+    VM_JitEmit(jit, 2, 0xFF, 0xD0); /* call rax */
+    VM_JitEmit1(jit, 0xE9);         /* jmp epilogue */
+    VM_JitRel32(jit, jit->epilogue);
+
+    jit->errorPc = jit->ofs;
+    VM_JitEmit1(jit, 0xBE); /* mov esi, VM_PC_OUT_OF_RANGE */
+    VM_JitEmit4(jit, VM_PC_OUT_OF_RANGE);
+    VM_JitEmit1(jit, 0xE9); /* jmp error */
+    VM_JitRel32(jit, jit->error);
+
+    jit->errorStack = jit->ofs;
+    VM_JitEmit1(jit, 0xBE); /* mov esi, VM_STACK_OVERFLOW */
+    VM_JitEmit4(jit, VM_STACK_OVERFLOW);
+    VM_JitEmit1(jit, 0xE9); /* jmp error */
+    VM_JitRel32(jit, jit->error);
+
+    jit->errorOp = jit->ofs;
+    VM_JitEmit1(jit, 0xBE); /* mov esi, VM_BAD_INSTRUCTION */
+    VM_JitEmit4(jit, VM_BAD_INSTRUCTION);
+    VM_JitEmit1(jit, 0xE9); /* jmp error */
+    VM_JitRel32(jit, jit->error);
+
+    jit->errorData = jit->ofs;
+    VM_JitEmit1(jit, 0xBE); /* mov esi, VM_DATA_OUT_OF_RANGE */
+    VM_JitEmit4(jit, VM_DATA_OUT_OF_RANGE);
+    VM_JitEmit1(jit, 0xE9); /* jmp error */
+    VM_JitRel32(jit, jit->error);
+
+    /* OP_CALL: instruction number or negative syscall number in eax */
+    jit->callStub = jit->ofs;
+    VM_JitEmit(jit, 2, 0x85, 0xC0);       /* test eax, eax */
+    VM_JitEmit(jit, 2, 0x0F, 0x88);       /* js sysCall */
+    VM_JitRel32(jit, jit->sysCall);
+    VM_JitEmit1(jit, 0x3D); /* cmp eax, instructionCount */
+    VM_JitEmit4(jit, vm->instructionCount);
+    VM_JitEmit(jit, 2, 0x0F, 0x83); /* jae errorPc */
+    VM_JitRel32(jit, jit->errorPc);
+    VM_JitEmit(jit, 4, 0x49, 0x3B, 0x65,
+               (int)offsetof(vmJitContext_t, stackLimit)); /* cmp rsp, [r13] */
+    VM_JitEmit(jit, 2, 0x0F, 0x82); /* jb errorStack */
+    VM_JitRel32(jit, jit->errorStack);
+    VM_JitEmit(jit, 2, 0x48, 0xB9); /* mov rcx, table */
+    VM_JitEmit8(jit, (intptr_t)jit->table);
+    VM_JitEmit(jit, 3, 0xFF, 0x24, 0xC1); /* jmp [rcx + rax*8] */
+
+    /* system call, the result is pushed on the op stack */
+    jit->sysCall = jit->ofs;
+    VM_JitEmit(jit, 3, 0x4C, 0x89, 0xEF); /* mov rdi, r13 */
+    VM_JitEmit(jit, 2, 0x89, 0xC6);       /* mov esi, eax */
+    VM_JitEmit(jit, 3, 0x44, 0x89, 0xFA); /* mov edx, r15d */
+    VM_JitCallC(jit, (intptr_t)VM_JitSystemCall);
+    VM_JitEmit(jit, 3, 0x80, 0xC3, 0x01); /* add bl, 1 */
+    VM_JitOpStack(jit, 0, 0x41, 0x89, JIT_NONE, 0, JIT_TOP); /* mov [], eax */
+    VM_JitEmit1(jit, 0xC3);                                  /* ret */
+
+    /* OP_JUMP: instruction number in eax */
+    jit->jumpStub = jit->ofs;
+    VM_JitEmit1(jit, 0x3D); /* cmp eax, instructionCount */
+    VM_JitEmit4(jit, vm->instructionCount);
+    VM_JitEmit(jit, 2, 0x0F, 0x83); /* jae errorPc */
+    VM_JitRel32(jit, jit->errorPc);
+    VM_JitEmit(jit, 2, 0x48, 0xB9); /* mov rcx, table */
+    VM_JitEmit8(jit, (intptr_t)jit->table);
+    VM_JitEmit(jit, 3, 0xFF, 0x24, 0xC1); /* jmp [rcx + rax*8] */
+}
+
+/** Emit a conditional jump to an instruction.
+ * @param[in,out] jit Code generator state.
+ * @param[in] cc Second opcode byte of the jcc rel32 instruction.
+ * @param[in] target Jump target (index into vm->codeBase). */
+static void VM_JitJcc(vmJit_t* jit, int cc, int target)
+{
+    VM_JitEmit(jit, 2, 0x0F, cc);
+    VM_JitRel32(jit, jit->nativeOfs[target]);
+}
+
+/** Translate every instruction in vm->codeBase.
+ * @param[in] vm Current VM, prepared by VM_PrepareInterpreter.
+ * @param[in,out] jit Code generator state. */
+static void VM_JitInstructions(const vm_t* vm, vmJit_t* jit)
+{
+    const int* code = (const int*)vm->codeBase;
+    int        pc   = 0;
+    int        instruction;
+    int        op;
+    int        v;
+
+    for (instruction = 0; instruction < vm->instructionCount; instruction++)
     {
-        return sym->symName;
+        jit->nativeOfs[pc] = jit->ofs;
+        op                 = code[pc++];
+        if (op >= OP_MAX)
+        {
+            /* superinstruction: the original sequence is still in the
+               code image, so just translate the first op code */
+            op = fusedBaseOp[op - OP_MAX];
+        }
+
+        switch (op)
+        {
+        case OP_IGNORE:
+            break;
+        case OP_BREAK:
+            VM_JitEmit(jit, 4, 0x49, 0x8B, 0x45,
+                       (int)offsetof(vmJitContext_t, vm)); /* mov rax, [r13] */
+            VM_JitEmit(jit, 2, 0xFF, 0x80); /* inc dword [rax + breakCount] */
+            VM_JitEmit4(jit, (int)offsetof(vm_t, breakCount));
+            break;
+        case OP_ENTER:
+            v = code[pc++];
+            VM_JitEmit(jit, 3, 0x41, 0x81, 0xEF); /* sub r15d, v */
+            VM_JitEmit4(jit, v);
+            VM_JitEmit(jit, 3, 0x44, 0x89, 0xF8); /* mov eax, r15d */
+            VM_JitEmit1(jit, 0x2D);               /* sub eax, stackBottom */
+            VM_JitEmit4(jit, vm->stackBottom);
+            VM_JitEmit1(jit, 0x3D); /* cmp eax, stackSize */
+            VM_JitEmit4(jit, vm->stackSize);
+            VM_JitEmit(jit, 2, 0x0F, 0x87); /* ja errorStack */
+            VM_JitRel32(jit, jit->errorStack);
+            break;
+        case OP_LEAVE:
+            v = code[pc++];
+            VM_JitEmit(jit, 3, 0x41, 0x81, 0xC7); /* add r15d, v */
+            VM_JitEmit4(jit, v);
+            VM_JitEmit1(jit, 0xC3); /* ret */
+            break;
+        case OP_CALL:
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 0, JIT_TOP);
+            VM_JitEmit(jit, 3, 0x80, 0xEB, 0x01); /* sub bl, 1 */
+            VM_JitEmit1(jit, 0xE8);               /* call callStub */
+            VM_JitRel32(jit, jit->callStub);
+            break;
+        case OP_PUSH:
+            VM_JitEmit(jit, 3, 0x80, 0xC3, 0x01); /* add bl, 1 */
+            break;
+        case OP_POP:
+            VM_JitEmit(jit, 3, 0x80, 0xEB, 0x01); /* sub bl, 1 */
+            break;
+        case OP_CONST:
+            v = code[pc++];
+            VM_JitEmit(jit, 3, 0x80, 0xC3, 0x01); /* add bl, 1 */
+            VM_JitOpStack(jit, 0, 0x41, 0xC7, JIT_NONE, 0, JIT_TOP);
+            VM_JitEmit4(jit, v); /* mov dword [top], v */
+            break;
+        case OP_LOCAL:
+            v = code[pc++];
+            VM_JitEmit(jit, 3, 0x80, 0xC3, 0x01); /* add bl, 1 */
+            VM_JitEmit(jit, 3, 0x41, 0x8D, 0x87); /* lea eax, [r15 + v] */
+            VM_JitEmit4(jit, v);
+            VM_JitOpStack(jit, 0, 0x41, 0x89, JIT_NONE, 0, JIT_TOP);
+            break;
+        case OP_JUMP:
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 0, JIT_TOP);
+            VM_JitEmit(jit, 3, 0x80, 0xEB, 0x01); /* sub bl, 1 */
+            VM_JitEmit1(jit, 0xE9);               /* jmp jumpStub */
+            VM_JitRel32(jit, jit->jumpStub);
+            break;
+        case OP_EQ:
+        case OP_NE:
+        case OP_LTI:
+        case OP_LEI:
+        case OP_GTI:
+        case OP_GEI:
+        case OP_LTU:
+        case OP_LEU:
+        case OP_GTU:
+        case OP_GEU:
+        {
+            static const int jcc[] = {
+                0x84, 0x85, 0x8C, 0x8E, 0x8F, 0x8D, 0x82, 0x86, 0x87, 0x83,
+            }; /* je, jne, jl, jle, jg, jge, jb, jbe, ja, jae */
+            v = code[pc++];
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 0, JIT_NEXT);
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 1, JIT_TOP);
+            VM_JitEmit(jit, 3, 0x80, 0xEB, 0x02); /* sub bl, 2 */
+            VM_JitEmit(jit, 2, 0x39, 0xC8);       /* cmp eax, ecx */
+            VM_JitJcc(jit, jcc[op - OP_EQ], v);
+            break;
+        }
+        case OP_EQF:
+        case OP_NEF:
+        case OP_LTF:
+        case OP_LEF:
+        case OP_GTF:
+        case OP_GEF:
+            v = code[pc++];
+            /* movss xmm0, [next]; movss xmm1, [top] */
+            VM_JitOpStack(jit, 0xF3, 0x41, 0x0F, 0x10, 0, JIT_NEXT);
+            VM_JitOpStack(jit, 0xF3, 0x41, 0x0F, 0x10, 1, JIT_TOP);
+            VM_JitEmit(jit, 3, 0x80, 0xEB, 0x02); /* sub bl, 2 */
+            /* unordered (NaN) sets ZF, PF and CF */
+            switch (op)
+            {
+            case OP_EQF:
+                VM_JitEmit(jit, 3, 0x0F, 0x2E, 0xC1); /* ucomiss xmm0, xmm1 */
+                VM_JitEmit(jit, 2, 0x7A, 0x06);       /* jp +6 */
+                VM_JitJcc(jit, 0x84, v);              /* je */
+                break;
+            case OP_NEF:
+                VM_JitEmit(jit, 3, 0x0F, 0x2E, 0xC1); /* ucomiss xmm0, xmm1 */
+                VM_JitJcc(jit, 0x8A, v);              /* jp */
+                VM_JitJcc(jit, 0x85, v);              /* jne */
+                break;
+            case OP_LTF:
+                VM_JitEmit(jit, 3, 0x0F, 0x2E, 0xC8); /* ucomiss xmm1, xmm0 */
+                VM_JitJcc(jit, 0x87, v);              /* ja */
+                break;
+            case OP_LEF:
+                VM_JitEmit(jit, 3, 0x0F, 0x2E, 0xC8); /* ucomiss xmm1, xmm0 */
+                VM_JitJcc(jit, 0x83, v);              /* jae */
+                break;
+            case OP_GTF:
+                VM_JitEmit(jit, 3, 0x0F, 0x2E, 0xC1); /* ucomiss xmm0, xmm1 */
+                VM_JitJcc(jit, 0x87, v);              /* ja */
+                break;
+            default: /* OP_GEF */
+                VM_JitEmit(jit, 3, 0x0F, 0x2E, 0xC1); /* ucomiss xmm0, xmm1 */
+                VM_JitJcc(jit, 0x83, v);              /* jae */
+                break;
+            }
+            break;
+        case OP_LOAD1:
+        case OP_LOAD2:
+        case OP_LOAD4:
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 0, JIT_TOP);
+#if defined(USE_BOUNDS_CHECK)
+            VM_JitEmit1(jit, 0x3D); /* cmp eax, dataLength */
+            VM_JitEmit4(jit, vm->dataLength);
+            VM_JitEmit(jit, 2, 0x0F, 0x83); /* jae errorData */
+            VM_JitRel32(jit, jit->errorData);
+#elif !defined(USE_GUARD_PAGES) /* eax is zero extended: guard pages */
+            VM_JitEmit1(jit, 0x25); /* and eax, dataMask */
+            VM_JitEmit4(jit, vm->dataMask);
+#endif
+            if (op == OP_LOAD4)
+            {
+                VM_JitEmit(jit, 4, 0x41, 0x8B, 0x04, 0x04); /* mov eax, [] */
+            }
+            else /* movzx eax, byte/word [r12 + rax] */
+            {
+                VM_JitEmit(jit, 5, 0x41, 0x0F, op == OP_LOAD1 ? 0xB6 : 0xB7,
+                           0x04, 0x04);
+            }
+            VM_JitOpStack(jit, 0, 0x41, 0x89, JIT_NONE, 0, JIT_TOP);
+            break;
+        case OP_STORE1:
+        case OP_STORE2:
+        case OP_STORE4:
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 0, JIT_TOP);
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 1, JIT_NEXT);
+#if defined(USE_BOUNDS_CHECK)
+            VM_JitEmit(jit, 2, 0x81, 0xF9); /* cmp ecx, dataLength */
+            VM_JitEmit4(jit, vm->dataLength);
+            VM_JitEmit(jit, 2, 0x0F, 0x83); /* jae errorData */
+            VM_JitRel32(jit, jit->errorData);
+#elif !defined(USE_GUARD_PAGES)
+            VM_JitEmit(jit, 2, 0x81, 0xE1); /* and ecx, dataMask */
+            VM_JitEmit4(jit, vm->dataMask);
+#endif
+            if (op == OP_STORE2)
+            {
+                VM_JitEmit1(jit, 0x66); /* operand size prefix */
+            }
+            /* mov [r12 + rcx], al/ax/eax */
+            VM_JitEmit(jit, 4, 0x41, op == OP_STORE1 ? 0x88 : 0x89, 0x04,
+                       0x0C);
+            VM_JitEmit(jit, 3, 0x80, 0xEB, 0x02); /* sub bl, 2 */
+            break;
+        case OP_ARG:
+            v = code[pc++];
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 0, JIT_TOP);
+            VM_JitEmit(jit, 3, 0x80, 0xEB, 0x01); /* sub bl, 1 */
+            VM_JitEmit(jit, 3, 0x41, 0x8D, 0x8F); /* lea ecx, [r15 + v] */
+            VM_JitEmit4(jit, v);
+#if defined(USE_BOUNDS_CHECK)
+            VM_JitEmit(jit, 2, 0x81, 0xF9); /* cmp ecx, dataLength */
+            VM_JitEmit4(jit, vm->dataLength);
+            VM_JitEmit(jit, 2, 0x0F, 0x83); /* jae errorData */
+            VM_JitRel32(jit, jit->errorData);
+#elif !defined(USE_GUARD_PAGES)
+            VM_JitEmit(jit, 2, 0x81, 0xE1); /* and ecx, dataMask */
+            VM_JitEmit4(jit, vm->dataMask);
+#endif
+            VM_JitEmit(jit, 4, 0x41, 0x89, 0x04, 0x0C); /* mov [r12+rcx], eax */
+            break;
+        case OP_BLOCK_COPY:
+            v = code[pc++];
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 7, JIT_NEXT);
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 6, JIT_TOP);
+            VM_JitEmit1(jit, 0xBA); /* mov edx, v */
+            VM_JitEmit4(jit, v);
+            VM_JitEmit(jit, 4, 0x49, 0x8B, 0x4D,
+                       (int)offsetof(vmJitContext_t, vm)); /* mov rcx, [r13] */
+            VM_JitCallC(jit, (intptr_t)VM_BlockCopy);
+            VM_JitEmit(jit, 3, 0x80, 0xEB, 0x02); /* sub bl, 2 */
+            break;
+        case OP_SEX8:
+        case OP_SEX16: /* movsx eax, byte/word [top] */
+            VM_JitOpStack(jit, 0, 0x41, 0x0F, op == OP_SEX8 ? 0xBE : 0xBF, 0,
+                          JIT_TOP);
+            VM_JitOpStack(jit, 0, 0x41, 0x89, JIT_NONE, 0, JIT_TOP);
+            break;
+        case OP_NEGI:
+            VM_JitOpStack(jit, 0, 0x41, 0xF7, JIT_NONE, 3, JIT_TOP);
+            break;
+        case OP_BCOM:
+            VM_JitOpStack(jit, 0, 0x41, 0xF7, JIT_NONE, 2, JIT_TOP);
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_BAND:
+        case OP_BOR:
+        case OP_BXOR:
+            /* mov eax, [top]; sub bl, 1; add/sub/and/or/xor [top], eax */
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 0, JIT_TOP);
+            VM_JitEmit(jit, 3, 0x80, 0xEB, 0x01);
+            VM_JitOpStack(jit, 0, 0x41,
+                          op == OP_ADD
+                              ? 0x01
+                              : op == OP_SUB
+                                    ? 0x29
+                                    : op == OP_BAND
+                                          ? 0x21
+                                          : op == OP_BOR ? 0x09 : 0x31,
+                          JIT_NONE, 0, JIT_TOP);
+            break;
+        case OP_DIVI:
+        case OP_DIVU:
+        case OP_MODI:
+        case OP_MODU:
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 0, JIT_NEXT);
+            if (op == OP_DIVI || op == OP_MODI)
+            {
+                VM_JitEmit1(jit, 0x99); /* cdq */
+                VM_JitOpStack(jit, 0, 0x41, 0xF7, JIT_NONE, 7, JIT_TOP);
+            }
+            else
+            {
+                VM_JitEmit(jit, 2, 0x31, 0xD2); /* xor edx, edx */
+                VM_JitOpStack(jit, 0, 0x41, 0xF7, JIT_NONE, 6, JIT_TOP);
+            }
+            VM_JitEmit(jit, 3, 0x80, 0xEB, 0x01); /* sub bl, 1 */
+            /* quotient in eax, remainder in edx */
+            VM_JitOpStack(jit, 0, 0x41, 0x89, JIT_NONE,
+                          (op == OP_DIVI || op == OP_DIVU) ? 0 : 2, JIT_TOP);
+            break;
+        case OP_MULI:
+        case OP_MULU:
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 0, JIT_NEXT);
+            VM_JitOpStack(jit, 0, 0x41, 0x0F, 0xAF, 0, JIT_TOP); /* imul */
+            VM_JitEmit(jit, 3, 0x80, 0xEB, 0x01);                /* sub bl, 1 */
+            VM_JitOpStack(jit, 0, 0x41, 0x89, JIT_NONE, 0, JIT_TOP);
+            break;
+        case OP_LSH:
+        case OP_RSHI:
+        case OP_RSHU:
+            VM_JitOpStack(jit, 0, 0x41, 0x8B, JIT_NONE, 1, JIT_TOP);
+            VM_JitEmit(jit, 3, 0x80, 0xEB, 0x01); /* sub bl, 1 */
+            /* shl/sar/shr dword [top], cl */
+            VM_JitOpStack(jit, 0, 0x41, 0xD3, JIT_NONE,
+                          op == OP_LSH ? 4 : op == OP_RSHI ? 7 : 5, JIT_TOP);
+            break;
+        case OP_NEGF:
+            VM_JitOpStack(jit, 0, 0x41, 0x81, JIT_NONE, 6, JIT_TOP);
+            VM_JitEmit4(jit, (int)0x80000000); /* xor dword [top], sign */
+            break;
+        case OP_ADDF:
+        case OP_SUBF:
+        case OP_DIVF:
+        case OP_MULF:
+            VM_JitOpStack(jit, 0xF3, 0x41, 0x0F, 0x10, 0, JIT_NEXT);
+            /* addss/subss/divss/mulss xmm0, [top] */
+            VM_JitOpStack(jit, 0xF3, 0x41, 0x0F,
+                          op == OP_ADDF
+                              ? 0x58
+                              : op == OP_SUBF ? 0x5C : op == OP_DIVF ? 0x5E
+                                                                     : 0x59,
+                          0, JIT_TOP);
+            VM_JitEmit(jit, 3, 0x80, 0xEB, 0x01); /* sub bl, 1 */
+            VM_JitOpStack(jit, 0xF3, 0x41, 0x0F, 0x11, 0, JIT_TOP);
+            break;
+        case OP_CVIF: /* cvtsi2ss xmm0, [top] */
+            VM_JitOpStack(jit, 0xF3, 0x41, 0x0F, 0x2A, 0, JIT_TOP);
+            VM_JitOpStack(jit, 0xF3, 0x41, 0x0F, 0x11, 0, JIT_TOP);
+            break;
+        case OP_CVFI: /* cvttss2si rax, [top] */
+            VM_JitOpStack(jit, 0xF3, 0x49, 0x0F, 0x2C, 0, JIT_TOP);
+            VM_JitOpStack(jit, 0, 0x41, 0x89, JIT_NONE, 0, JIT_TOP);
+            break;
+        default: /* OP_UNDEF */
+            VM_JitEmit1(jit, 0xE9); /* jmp errorOp */
+            VM_JitRel32(jit, jit->errorOp);
+            break;
+        }
+    }
+}
+
+static int VM_Compile(vm_t* vm)
+{
+    vmJit_t  jit;
+    uint8_t* mem  = NULL;
+    size_t   size = 0;
+    size_t   codeSize;
+    int      pass;
+    int      i;
+
+    Com_Memset(&jit, 0, sizeof(jit));
+    jit.nativeOfs =
+        (int*)Com_malloc(vm->codeLength * sizeof(int), vm, VM_ALLOC_JIT);
+    if (!jit.nativeOfs)
+    {
+        Com_Printf("JIT: out of memory, using the interpreter\n");
+        return -1;
+    }
+    Com_Memset(jit.nativeOfs, 0, vm->codeLength * sizeof(int));
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        jit.ofs = 0;
+        VM_JitStubs(vm, &jit);
+        VM_JitInstructions(vm, &jit);
+
+        if (pass == 0)
+        {
+            /* the instruction table follows the code */
+            codeSize = PAD(jit.ofs, sizeof(intptr_t));
+            size     = codeSize + vm->instructionCount * sizeof(intptr_t);
+            mem = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == (uint8_t*)MAP_FAILED)
+            {
+                Com_free(jit.nativeOfs, vm, VM_ALLOC_JIT);
+                Com_Printf("JIT: mmap failed, using the interpreter\n");
+                return -1;
+            }
+            jit.buf   = mem;
+            jit.table = (intptr_t*)(mem + codeSize);
+            for (i = 0; i < vm->instructionCount; i++)
+            {
+                jit.table[i] = (intptr_t)(
+                    mem + jit.nativeOfs[vm->instructionPointers[i]]);
+            }
+        }
+    }
+    Com_free(jit.nativeOfs, vm, VM_ALLOC_JIT);
+
+    /* W^X: the code is never writable and executable at the same time */
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(mem, size);
+        Com_Printf("JIT: mprotect failed, using the interpreter\n");
+        return -1;
+    }
+    vm->jitCode       = mem;
+    vm->jitCodeLength = size;
+
+    return 0;
+}
+
+static int VM_CallCompiled(vm_t* vm, int function, int argc, const int* args,
+                           int count, intptr_t* results)
+{
+    /* one item below the op stack as the native code reads the next item
+       without wrapping the index */
+    int            opStack[OPSTACK_SIZE / sizeof(int) + 2];
+    vmJitContext_t ctx;
+    int            programStack;
+    int            stackOnEntry;
+    uint8_t*       image;
+    int            arg;
+    int            call;
+    int            r = 0;
+    union {
+        uint8_t* p;
+        void (*f)(vmJitContext_t*);
+    } code;
+
+    vm->currentlyInterpreting = 1;
+
+    /* we might be called recursively, so this might not be the very top */
+    programStack = stackOnEntry = vm->programStack;
+
+    image  = vm->dataBase;
+    code.p = vm->jitCode;
+    /* reserve the frame for all arguments, but only copy the passed ones */
+    programStack -= (8 + 4 * MAX_VMMAIN_ARGS);
+
+    ctx.vm       = vm;
+    ctx.dataBase = image;
+    ctx.opStack  = &opStack[1];
+    /* the instruction table is at the end of the native code */
+    ctx.entry = ((const intptr_t*)(vm->jitCode + vm->jitCodeLength) -
+                 vm->instructionCount)[function];
+
+    for (call = 0; call < count; call++)
+    {
+        for (arg = 0; arg < argc; arg++)
+        {
+            *(int*)&image[programStack + 8 + arg * 4] = args[call * argc + arg];
+        }
+
+        *(int*)&image[programStack + 4] = 0; /* return stack */
+        *(int*)&image[programStack]     = -1;
+
+        opStack[0] = 0;
+        opStack[1] = 0x0000BEEF;
+
+        ctx.savedStack   = 0;
+        ctx.stackLimit   = 0;
+        ctx.programStack = programStack;
+        ctx.opStackOfs   = 0;
+        ctx.error        = VM_NO_ERROR;
+
+        code.f(&ctx);
+
+        if (ctx.error != VM_NO_ERROR)
+        {
+            r = -1;
+            break;
+        }
+        if (ctx.opStackOfs != 1 || ctx.opStack[0] != 0x0000BEEF)
+        {
+            Com_Error(vm->lastError = VM_STACK_ERROR,
+                      "Interpreter stack error");
+        }
+
+        /* the result of the bytecode computations */
+        r = ctx.opStack[ctx.opStackOfs];
+        if (results)
+        {
+            results[call] = r;
+        }
+    }
+
+    vm->currentlyInterpreting = 0;
+    vm->programStack          = stackOnEntry;
+
+    return r;
+}
+#endif /* USE_JIT_X64 */
+
+/* DEBUG FUNCTIONS */
+/* --------------- */
+
+void VM_Debug(int level)
+{
+    vm_debugLevel = level;
+}
+
+#ifdef DEBUG_VM
+static char* VM_Indent(vm_t* vm)
+{
+    static char* string = "                                        ";
+    if (vm->callLevel > 20)
+    {
+        return string;
     }
-
-    snprintf(text, sizeof(text), "%s+%i", sym->symName, value - sym->symValue);
-
-    return text;
+    return string + 2 * (20 - vm->callLevel);
 }
 
-static vmSymbol_t* VM_ValueToFunctionSymbol(vm_t* vm, int value)
+static const char* VM_ValueToSymbol(vm_t* vm, int value, char* text,
+                                    size_t textSize)
 {
-    vmSymbol_t*       sym;
-    static vmSymbol_t nullSym;
+    vmSymbol_t* sym;
 
-    sym = vm->symbols;
+    sym = VM_FindSymbol(vm, value);
     if (!sym)
     {
-        return &nullSym;
+        return "NO SYMBOLS";
     }
 
-    while (sym->next && sym->next->symValue <= value)
+    if (value == sym->symValue)
     {
-        sym = sym->next;
+        return sym->symName;
     }
 
-    return sym;
+    snprintf(text, textSize, "%s+%i", sym->symName, value - sym->symValue);
+
+    return text;
 }
 
-static int ParseHex(const char* text)
+static vmSymbol_t* VM_ValueToFunctionSymbol(vm_t* vm, int value)
 {
-    int value;
-    int c;
-
-    value = 0;
-    while ((c = *text++) != 0)
-    {
-        if (c >= '0' && c <= '9')
-        {
-            value = value * 16 + c - '0';
-            continue;
-        }
-        if (c >= 'a' && c <= 'f')
-        {
-            value = value * 16 + 10 + c - 'a';
-            continue;
-        }
-        if (c >= 'A' && c <= 'F')
-        {
-            value = value * 16 + 10 + c - 'A';
-            continue;
-        }
-    }
-
-    return value;
+    return VM_FindSymbol(vm, value);
 }
 
 static void COM_StripExtension(const char* in, char* out)
@@ -1676,7 +5536,7 @@ uint8_t* loadImage(const char* filepath, int* size)
     }
     rewind(f);
 
-    image = (uint8_t*)malloc(sz);
+    image = (uint8_t*)malloc(sz + 1); /* + 1: zero terminated text */
     if (!image)
     {
         fclose(f);
@@ -1691,247 +5551,45 @@ uint8_t* loadImage(const char* filepath, int* size)
     }
 
     fclose(f);
-    *size = sz;
+    image[sz] = 0;
+    *size     = sz;
     return image;
 }
 
-static char* SkipWhitespace(char* data, int* hasNewLines)
-{
-    int c;
-
-    while ((c = *data) <= ' ')
-    {
-        if (!c)
-        {
-            return NULL;
-        }
-        if (c == '\n')
-        {
-            com_lines++;
-            *hasNewLines = 1;
-        }
-        data++;
-    }
-
-    return data;
-}
-
-static char* COM_Parse(char** data_p)
-{
-    int   c           = 0, len;
-    int   hasNewLines = 0;
-    char* data;
-    int   allowLineBreaks = 1;
-
-    data          = *data_p;
-    len           = 0;
-    com_token[0]  = 0;
-    com_tokenline = 0;
-
-    /* make sure incoming data is valid */
-    if (!data)
-    {
-        *data_p = NULL;
-        return com_token;
-    }
-
-    while (1)
-    {
-        /* skip whitespace */
-        data = SkipWhitespace(data, &hasNewLines);
-        if (!data)
-        {
-            *data_p = NULL;
-            return com_token;
-        }
-        if (hasNewLines && !allowLineBreaks)
-        {
-            *data_p = data;
-            return com_token;
-        }
-
-        c = *data;
-
-        /* skip double slash comments */
-        if (c == '/' && data[1] == '/')
-        {
-            data += 2;
-            while (*data && *data != '\n')
-            {
-                data++;
-            }
-        }
-        /* skip comments */
-        else if (c == '/' && data[1] == '*')
-        {
-            data += 2;
-            while (*data && (*data != '*' || data[1] != '/'))
-            {
-                if (*data == '\n')
-                {
-                    com_lines++;
-                }
-                data++;
-            }
-            if (*data)
-            {
-                data += 2;
-            }
-        }
-        else
-        {
-            break;
-        }
-    }
-
-    /* token starts on this line */
-    com_tokenline = com_lines;
-
-    /* handle quoted strings */
-    if (c == '\"')
-    {
-        data++;
-        while (1)
-        {
-            c = *data++;
-            if (c == '\"' || !c)
-            {
-                com_token[len] = 0;
-                *data_p        = (char*)data;
-                return com_token;
-            }
-            if (c == '\n')
-            {
-                com_lines++;
-            }
-            if (len < MAX_TOKEN_CHARS - 1)
-            {
-                com_token[len] = c;
-                len++;
-            }
-        }
-    }
-
-    /* parse a regular word */
-    do
-    {
-        if (len < MAX_TOKEN_CHARS - 1)
-        {
-            com_token[len] = c;
-            len++;
-        }
-        data++;
-        c = *data;
-    } while (c > 32);
-
-    com_token[len] = 0;
-
-    *data_p = (char*)data;
-    return com_token;
-}
-
 static void VM_LoadSymbols(vm_t* vm)
 {
-    union {
-        char* c;
-        void* v;
-    } mapfile;
-    char *       text_p, *token;
-    char         name[VM_MAX_QPATH];
-    char         symbols[VM_MAX_QPATH];
-    vmSymbol_t **prev, *sym;
-    int          count;
-    int          value;
-    int          chars;
-    int          segment;
-    int          numInstructions;
-    int          imageSize;
+    char* mapfile;
+    char  name[VM_MAX_QPATH];
+    char  symbols[VM_MAX_QPATH];
+    int   imageSize;
+    int   count;
 
     COM_StripExtension(vm->name, name);
     snprintf(symbols, sizeof(symbols), "%s.map", name);
     Com_Printf("Loading symbol file: %s...\n", symbols);
-    mapfile.v = loadImage(symbols, &imageSize);
+    mapfile = (char*)loadImage(symbols, &imageSize);
 
-    if (!mapfile.c)
+    if (!mapfile)
     {
         Com_Printf("Couldn't load symbol file: %s\n", symbols);
         return;
     }
 
-    numInstructions = vm->instructionCount;
-
-    /* parse the symbols */
-    text_p = mapfile.c;
-    prev   = &vm->symbols;
-    count  = 0;
-
-    while (1)
-    {
-        token = COM_Parse(&text_p);
-        if (!token[0])
-        {
-            break;
-        }
-        segment = ParseHex(token);
-        if (segment)
-        {
-            COM_Parse(&text_p);
-            COM_Parse(&text_p);
-            continue; /* only load code segment values */
-        }
-
-        token = COM_Parse(&text_p);
-        if (!token[0])
-        {
-            Com_Printf("WARNING: incomplete line at end of file\n");
-            break;
-        }
-        value = ParseHex(token);
-
-        token = COM_Parse(&text_p);
-        if (!token[0])
-        {
-            Com_Printf("WARNING: incomplete line at end of file\n");
-            break;
-        }
-        chars = strlen(token);
-        sym   = Com_malloc(sizeof(*sym) + chars, NULL, VM_ALLOC_DEBUG);
-        *prev = sym;
-        if (!sym)
-        {
-            Com_Error(VM_MALLOC_FAILED,
-                      "Sym. pointer malloc failed: out of memory?");
-            break;
-        }
-        Com_Memset(sym, 0, sizeof(*sym) + chars);
-        prev      = &sym->next;
-        sym->next = NULL;
-
-        /* convert value from an instruction number to a code offset */
-        if (value >= 0 && value < numInstructions)
-        {
-            value = vm->instructionPointers[value];
-        }
-
-        sym->symValue = value;
-        Q_strncpyz(sym->symName, token, chars + 1);
-
-        count++;
-    }
-
-    vm->numSymbols = count;
+    count = VM_LoadMap(vm, mapfile);
     Com_Printf("%i symbols parsed from %s\n", count, symbols);
-    Com_free(mapfile.v, NULL, VM_ALLOC_DEBUG);
+    Com_free(mapfile, NULL, VM_ALLOC_DEBUG);
 }
 
 static void VM_StackTrace(vm_t* vm, int programCounter, int programStack)
 {
-    int count;
+    char text[MAX_TOKEN_CHARS];
+    int  count;
 
     count = 0;
     do
     {
-        Com_Printf("%s\n", VM_ValueToSymbol(vm, programCounter));
+        Com_Printf("%s\n",
+                   VM_ValueToSymbol(vm, programCounter, text, sizeof(text)));
         programStack   = *(int*)&vm->dataBase[programStack + 4];
         programCounter = *(int*)&vm->dataBase[programStack];
     } while (programCounter != -1 && ++count < 32);
@@ -2006,6 +5664,79 @@ void VM_VmProfile_f(const vm_t* vm)
 #else
 void VM_VmProfile_f(const vm_t* vm)
 {
-    (void)vm;
+    const vmProfile_t*         profile = VM_GetProfile(vm);
+    const vmProfileFunction_t* f;
+    int                        i;
+
+    if (!profile || profile->instructions == 0)
+    {
+        return;
+    }
+
+    Com_Printf("    calls    inclusive    exclusive function\n");
+    for (i = 0; i < profile->numFunctions; i++)
+    {
+        f = &profile->functions[i];
+        if (f->calls == 0 && f->exclusive == 0)
+        {
+            continue;
+        }
+        Com_Printf("%9lu %12lu %12lu ", (unsigned long)f->calls,
+                   (unsigned long)f->inclusive, (unsigned long)f->exclusive);
+        if (f->name)
+        {
+            Com_Printf("%s\n", f->name);
+        }
+        else
+        {
+            Com_Printf("@%i\n", f->function);
+        }
+    }
+    Com_Printf("%22lu total\n", (unsigned long)profile->instructions);
 }
 #endif
+
+static void VM_PrintOpcodeName(int opcode)
+{
+    const char* name = VM_OpcodeName(opcode);
+    if (name)
+    {
+        Com_Printf("%s,", name);
+    }
+    else
+    {
+        Com_Printf("%i,", opcode);
+    }
+}
+
+void VM_OpcodeProfile_f(const vm_t* vm)
+{
+    const vmProfile_t* profile = VM_GetProfile(vm);
+    int                a;
+    int                b;
+
+    if (!profile)
+    {
+        return;
+    }
+
+    Com_Printf("first,second,count\n");
+    for (a = 0; a < VM_OPCODE_COUNT; a++)
+    {
+        if (profile->opcodeCount[a] == 0)
+        {
+            continue; /* no pairs either */
+        }
+        VM_PrintOpcodeName(a);
+        Com_Printf(",%lu\n", (unsigned long)profile->opcodeCount[a]);
+        for (b = 0; b < VM_OPCODE_COUNT; b++)
+        {
+            if (profile->opcodePairs[a][b])
+            {
+                VM_PrintOpcodeName(a);
+                VM_PrintOpcodeName(b);
+                Com_Printf("%lu\n", (unsigned long)profile->opcodePairs[a][b]);
+            }
+        }
+    }
+}
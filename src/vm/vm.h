@@ -28,15 +28,39 @@
 #define DEBUG_VM /**< ifdef: enable debug functions and additional checks */
 #endif
 
+#if 0
+#define VM_NO_JIT /**< ifdef: never translate bytecode to native code */
+#endif
+
 /** File start magic number for .qvm files (4 bytes, little endian) */
 #define VM_MAGIC 0x12721444
 
-/** Don't change stack size: Hardcoded in q3asm and reserved at end of BSS */
+/** Stack size reserved by q3asm at the end of BSS. The default stack size
+ * of the VM, see vmCreateOptions_t::stackSize. */
 #define VM_PROGRAM_STACK_SIZE 0x10000
 
-/** Max. number of bytes in .qvm */
+/** Default max. number of bytes in .qvm */
 #define VM_MAX_IMAGE_SIZE 0x400000
 
+/** Default max. size of BSS section */
+#define VM_MAX_BSS_LENGTH 10485760
+
+/** Max. number of bytes in a data segment (data, lit, bss, heap and stack) */
+#define VM_MAX_DATA_LENGTH 0x40000000
+
+/** Max number of arguments to pass from engine to vm's vmMain function.
+ * command number + 12 arguments */
+#define MAX_VMMAIN_ARGS 13
+
+/** Max number of arguments to pass from a vm to engine's syscall handler
+ * function for the vm.
+ * syscall number + 15 arguments */
+#define MAX_VMSYSCALL_ARGS 16
+
+/** Size of the op code tables, all op codes (incl. the superinstructions of
+ * the interpreter) are smaller */
+#define VM_OPCODE_COUNT 128
+
 /**< Maximum length of a pathname, 64 to be Q3 compatible */
 #define VM_MAX_QPATH 64
 
@@ -69,14 +93,21 @@ typedef enum {
     VM_BLOCKCOPY_OUT_OF_RANGE      = -5,  /**< VM tries to escape sandbox */
     VM_PC_OUT_OF_RANGE             = -6,  /**< Program counter out of range */
     VM_JUMP_TO_INVALID_INSTRUCTION = -7,  /**< VM tries to escape sandbox */
-    VM_STACK_OVERFLOW              = -8,  /**< Only in DEBUG_VM mode */
+    VM_STACK_OVERFLOW              = -8,  /**< Only in DEBUG_VM or JIT mode */
     VM_STACK_MISALIGNED            = -9,  /**< Stack not aligned (DEBUG_VM) */
     VM_OP_LOAD4_MISALIGNED         = -10, /**< Access misaligned (DEBUG_VM) */
     VM_STACK_ERROR                 = -11, /**< Stack corrupted after call */
-    VM_DATA_OUT_OF_RANGE           = -12, /**< Syscall pointer not in sandbox */
+    VM_DATA_OUT_OF_RANGE           = -12, /**< Address not in sandbox */
     VM_MALLOC_FAILED               = -13, /**< Not enough memory */
     VM_BAD_INSTRUCTION             = -14, /**< Unknown OP code in bytecode */
     VM_NOT_LOADED                  = -15, /**< VM not loaded */
+    VM_SNAPSHOT_ON_RUNNING_VM      = -16, /**< Snapshot/restore while running */
+    VM_SNAPSHOT_MISMATCH           = -17, /**< Snapshot of another module */
+    VM_BAD_ARGUMENT_COUNT          = -18, /**< VM_CallArgs argc invalid */
+    VM_PROFILE_ON_RUNNING_VM       = -19, /**< VM_Profile while running */
+    VM_CALL_ON_SUSPENDED_VM        = -20, /**< VM_Call while suspended */
+    VM_NOT_SUSPENDED               = -21, /**< VM_Resume without a call */
+    VM_INVALID_OPTIONS             = -22, /**< Bad vmCreateOptions_t */
 } vmErrorCode_t;
 
 /** VM alloc type. This is just an information passed to the host malloc
@@ -86,7 +117,8 @@ typedef enum {
     VM_ALLOC_CODE_SEC             = 0, /**< Bytecode code section */
     VM_ALLOC_DATA_SEC             = 1, /**< Bytecode data section */
     VM_ALLOC_INSTRUCTION_POINTERS = 2, /**< Bytecode instruction pointers */
-    VM_ALLOC_DEBUG                = 3, /**< DEBUG_VM functions */
+    VM_ALLOC_DEBUG                = 3, /**< Symbols, profiler, DEBUG_VM */
+    VM_ALLOC_JIT                  = 4, /**< Temp. buffer for the JIT */
     VM_ALLOC_TYPE_MAX                  /**< Last item in vmMallocType_t */
 } vmMallocType_t;
 
@@ -104,7 +136,7 @@ typedef struct
     int32_t bssLength; /**< How many bytes should be used for .bss segment */
 } vmHeader_t;
 
-/** For debugging (DEBUG_VM): symbol list */
+/** Symbol list from the .map file, see VM_LoadMap */
 typedef struct vmSymbol_s
 {
     struct vmSymbol_s* next; /**< Linked list of symbols */
@@ -116,14 +148,108 @@ typedef struct vmSymbol_s
                           malloc at load time. */
 } vmSymbol_t;
 
+/** Profile of one function of the bytecode, see VM_Profile */
+typedef struct
+{
+    int         function;  /**< Instruction number of the function */
+    const char* name;      /**< Name from VM_LoadMap, NULL if unknown */
+    uint64_t    calls;     /**< Number of calls */
+    uint64_t    inclusive; /**< Instructions in the function and its callees */
+    uint64_t    exclusive; /**< Instructions in the function itself */
+} vmProfileFunction_t;
+
+/** Results of the profiler, see VM_Profile. A superinstruction counts as
+ * one instruction. */
+typedef struct
+{
+    uint64_t instructions;                 /**< Executed instructions */
+    uint64_t opcodeCount[VM_OPCODE_COUNT]; /**< Instructions per op code */
+    /** opcodePairs[a][b]: op code b executed right after op code a. The
+     * first instruction of a VM_Call has no predecessor. */
+    uint64_t opcodePairs[VM_OPCODE_COUNT][VM_OPCODE_COUNT];
+    int      numFunctions;                 /**< Entries in functions */
+    vmProfileFunction_t* functions;        /**< Sorted by instruction */
+    uint64_t samples; /**< Call stacks taken, see VM_ProfileSampling */
+} vmProfile_t;
+
+/** Saved data segment of a virtual machine, see VM_Snapshot */
+typedef struct
+{
+    uint8_t* data;         /**< Copy of the data segment below the stack */
+    int      dataLength;   /**< Number of bytes saved */
+    int      dataMask;     /**< dataMask of the saved vm */
+    int      programStack; /**< programStack of the saved vm */
+    int      heapTop;      /**< heapTop of the saved vm */
+    int      fd; /**< Memory file with the data (page tracking), 0 if unused */
+} vmSnapshot_t;
+
+/** Options of VM_CreateWithOptions. A field with 0 means the default. */
+typedef struct
+{
+    /** Bytes of program stack, replaces the VM_PROGRAM_STACK_SIZE that q3asm
+     * reserves at the end of BSS. Default: VM_PROGRAM_STACK_SIZE. */
+    int stackSize;
+    /** Bytes of zero filled memory for the host between BSS and the stack,
+     * see vm_t::heapBase. Default: no heap. */
+    int heapSize;
+    int maxImageSize; /**< Max. bytes of bytecode, def.: VM_MAX_IMAGE_SIZE */
+    int maxBssLength; /**< Max. bytes of BSS, def.: VM_MAX_BSS_LENGTH */
+    /** 1: take the code and data buffers from a pool of the buffers that
+     * VM_Free released, and give them back to the pool in VM_Free. Saves
+     * the page faults of fresh memory if VMs are created and freed often.
+     * See VM_ReleasePool. Default: Com_malloc and Com_free. */
+    int pooled;
+} vmCreateOptions_t;
+
+struct vm_s;
+
+/** Built-in implementations of common syscalls, see vmSystemCallEntry_t.
+ * They behave like the C library functions with the VM's memory and float
+ * types: pointers are VM addresses, floats are passed bit by bit in ints.
+ * The heap functions are a bump allocator in the heap of the VM (see
+ * vmCreateOptions_t::heapSize): allocations are 16 byte aligned and not
+ * freed one by one, but all at once or back to a mark. */
+typedef enum {
+    VM_INTRINSIC_NONE = 0, /**< No intrinsic: call the native handler */
+    VM_INTRINSIC_MEMSET,   /**< void* memset(void* dest, int c, size_t n) */
+    VM_INTRINSIC_MEMCPY,   /**< void* memcpy(void* dest, void* src, n) */
+    VM_INTRINSIC_MEMMOVE,  /**< void* memmove(void* dest, void* src, n) */
+    VM_INTRINSIC_STRLEN,   /**< size_t strlen(const char* s) */
+    VM_INTRINSIC_SQRT,     /**< float sqrt(float x) */
+    VM_INTRINSIC_SIN,      /**< float sin(float x) */
+    VM_INTRINSIC_COS,      /**< float cos(float x) */
+    VM_INTRINSIC_FLOOR,    /**< float floor(float x) */
+    VM_INTRINSIC_MALLOC,   /**< void* malloc(size_t n), NULL if full */
+    VM_INTRINSIC_HEAPMARK, /**< int heapmark(void): mark for heapreset */
+    VM_INTRINSIC_HEAPRESET,   /**< void heapreset(int mark): free the
+                                   allocations after heapmark */
+    VM_INTRINSIC_HEAPFREEALL, /**< void heapfreeall(void) */
+    VM_INTRINSIC_MAX       /**< Last item in vmIntrinsic_t */
+} vmIntrinsic_t;
+
+/** Native handler for one syscall number, see VM_SetSystemCalls */
+typedef struct
+{
+    /** Same as vm_t::systemCall, but only for this syscall number. args[0]
+     * is the syscall number, args[1] to args[argc] are the arguments.
+     * NULL: use vm_t::systemCall. */
+    intptr_t (*function)(struct vm_s* vm, intptr_t* args);
+    int argc; /**< Arguments read by function, 0 to MAX_VMSYSCALL_ARGS - 1 */
+    /** Run this built-in function in the VM instead of calling function.
+     * Memory ranges are checked as with VM_MemoryRangeValid. */
+    vmIntrinsic_t intrinsic;
+} vmSystemCallEntry_t;
+
 /** Main struct (think of a kind of a main class) to keep all information of
  * the virtual machine together. Has pointer to the bytecode, the stack and
  * everything. Call VM_Create(...) to initialize this struct. Call VM_Free(...)
- * to cleanup this struct and free the memory. */
+ * to cleanup this struct and free the memory.
+ * A vm_t must not be used by more than one thread at the same time. Use
+ * VM_CreateInstance(...) to get an instance for every thread. */
 typedef struct vm_s
 {
-    /* DO NOT MOVE OR CHANGE THESE WITHOUT CHANGING THE VM_OFFSET_* DEFINES
-       USED BY THE ASM CODE (IF WE ADD THE Q3 JIT COMPILER IN THE FUTURE) */
+    /* The JIT does not access vm_t from the generated code (it works with a
+       private context structure), so the layout is not fixed. */
 
     int programStack; /**< Stack pointer into .data segment. */
 
@@ -138,6 +264,12 @@ typedef struct vm_s
      * index might help a lookup table. */
     intptr_t (*systemCall)(struct vm_s* vm, intptr_t* parms);
 
+    /** Handlers indexed by the syscall number (0 based, like parms[0] of
+     * systemCall), see VM_SetSystemCalls. Numbers without a handler go to
+     * systemCall. */
+    const vmSystemCallEntry_t* systemCalls;
+    int numSystemCalls; /**< Number of entries in systemCalls */
+
     /*------------------------------------*/
 
     char  name[VM_MAX_QPATH]; /** File name of the bytecode */
@@ -150,25 +282,42 @@ typedef struct vm_s
 
     int currentlyInterpreting; /**< Is the vm currently running? */
 
-    int      compiled;   /**< Is a JIT active? Otherwise interpreted */
+    int      compiled;   /**< Is a JIT active? Otherwise interpreted.
+                              Set to 0 to force the interpreter. */
     uint8_t* codeBase;   /**< Bytecode code segment */
     int      entryOfs;   /**< unused */
     int      codeLength; /**< Number of bytes in code segment */
 
     intptr_t* instructionPointers;
     int       instructionCount; /**< Number of instructions for VM */
-
-    uint8_t* dataBase;  /**< Start of .data memory segment */
-    int      dataMask;  /**< VM mask to protect access to dataBase */
-    int      dataAlloc; /**< Number of bytes allocated for dataBase */
+    int       fusionCount;      /**< Number of superinstructions in codeBase */
+    intptr_t* threadedCode;     /**< codeBase with handler addresses instead
+                                     of op codes (direct threading) */
+    int       verified;         /**< Passed the static verification? Then
+                                     some runtime checks are skipped */
+
+    uint8_t* dataBase;   /**< Start of .data memory segment */
+    int      dataMask;   /**< VM mask to protect access to dataBase, -1 with
+                              VM_GUARD_PAGES or VM_BOUNDS_CHECK */
+    int      dataAlloc;  /**< Number of bytes allocated for dataBase */
+    int      dataLength; /**< Number of bytes usable by the VM, the stack
+                              starts at the end */
 
     int stackBottom; /**< If programStack < stackBottom, error */
+    int stackSize;   /**< Bytes of program stack, see vmCreateOptions_t */
+    int heapBase;    /**< VM address of the heap of the host (16 byte
+                          aligned), see vmCreateOptions_t::heapSize */
+    int heapLength;  /**< Bytes in the heap of the host, 0: no heap */
+    int heapTop;     /**< Next free byte in the heap, see VM_INTRINSIC_MALLOC */
+    int pooled;      /**< Buffers from the pool, see vmCreateOptions_t */
 
     /*------------------------------------*/
 
+    int          numSymbols;  /**< Number of symbols from VM_LoadMap */
+    vmSymbol_t*  symbols;     /**< By VM_LoadMap: names of the code segment */
+    vmSymbol_t** symbolTable; /**< The symbols sorted by value */
+
     /* DEBUG_VM */
-    int         numSymbols; /**< Number of symbols from VM_LoadSymbols */
-    vmSymbol_t* symbols;    /**< By VM_LoadSymbols: names for debugging */
 
     int callLevel;     /**< Counts recursive VM_Call */
     int breakFunction; /**< For debugging: break at this function */
@@ -176,6 +325,31 @@ typedef struct vm_s
 
     /* non vanilla q3 area: */
     vmErrorCode_t lastError; /**< Last known error */
+
+    uint8_t* jitCode;       /**< Native code by the JIT, NULL if not compiled */
+    size_t   jitCodeLength; /**< Number of bytes mapped for jitCode */
+
+    /** The VM that owns the code, the instruction table, the native code and
+     * the symbols, if this VM was set up by VM_CreateInstance. NULL if this
+     * VM owns them. */
+    const struct vm_s* module;
+    uint8_t* initData;       /**< Initial .data and .lit for new instances */
+    int      initDataLength; /**< Number of bytes in initData */
+    int      initDataFd;     /**< Memory file with the initial data segment
+                                  for copy-on-write instances, 0 if unused */
+    int      dataMapped;     /**< Is dataBase a copy-on-write mapping of the
+                                  initDataFd of the module or of a snapshot? */
+
+    /** Prepared code shared with other VMs of the same code segment, NULL if
+     * the code is not in the code cache. */
+    struct vmCodeImage_s* codeImage;
+
+    struct vmProfiler_s* profiler; /**< Counters of VM_Profile, or NULL */
+    int                  profiling; /**< Count the instructions? */
+    int                  sampleInterval; /**< See VM_ProfileSampling */
+
+    struct vmBudget_s* budget;    /**< State of VM_SetBudget, or NULL */
+    int                suspended; /**< Is a call suspended? See VM_Resume */
 } vm_t;
 
 /******************************************************************************
@@ -199,10 +373,70 @@ typedef struct vm_s
 int VM_Create(vm_t* vm, const char* module, const uint8_t* bytecode, int length,
               intptr_t (*systemCalls)(vm_t*, intptr_t*));
 
+/** Initialize a virtual machine like VM_Create, with a different stack size,
+ * a heap for the host in the data segment or larger limits for the
+ * bytecode. Instances (VM_CreateInstance) get the same options.
+ * @param[out] vm Pointer to a virtual machine to initialize.
+ * @param[in] module Path to the bytecode file, see VM_Create.
+ * @param[in] bytecode Pointer to the bytecode, see VM_Create.
+ * @param[in] length Number of bytes in the bytecode array.
+ * @param[in] systemCalls Callback for native functions, see VM_Create.
+ * @param[in] options Sizes and limits, NULL: the defaults of VM_Create.
+ * @return 0 if everything is OK. -1 if something went wrong. */
+int VM_CreateWithOptions(vm_t* vm, const char* module, const uint8_t* bytecode,
+                         int length, intptr_t (*systemCalls)(vm_t*, intptr_t*),
+                         const vmCreateOptions_t* options);
+
+/** Initialize a new instance of a virtual machine that was loaded by
+ * VM_Create. The instance shares the read-only parts (code, instruction
+ * table, native code, symbols) with the module, but has its own data segment
+ * (with the initial .data and .lit content) and its own stack and state.
+ * On Linux the data segment is mapped copy-on-write from the module, so
+ * creating an instance is cheap and pages are only copied when written.
+ * Every thread can run its own instance. The module must not be freed before
+ * all of its instances. VM_CreateInstance itself only reads the module, so
+ * instances can be created while the module or other instances are running.
+ * @param[out] vm Pointer to the new instance.
+ * @param[in] module VM set up by VM_Create (or an instance of it).
+ * @return 0 if everything is OK. -1 if something went wrong. */
+int VM_CreateInstance(vm_t* vm, const vm_t* module);
+
 /** Free the memory of the virtual machine.
  * @param[in] vm Pointer to initialized virtual machine. */
 void VM_Free(vm_t* vm);
 
+/** Return the buffers kept for pooled VMs (vmCreateOptions_t::pooled) to
+ * the host with Com_free. The pool is filled again by the next VM_Free of a
+ * pooled VM. Call it e.g. before the host shuts down. */
+void VM_ReleasePool(void);
+
+/** Save the data segment and the program stack of a virtual machine. Reset
+ * the vm to this state later with VM_Restore, that is a lot faster than
+ * VM_Free and VM_Create. The stack area is not saved: it is unused between
+ * two calls.
+ * With trackPages (Linux only) the snapshot is kept in a memory file and the
+ * vm continues on a copy-on-write mapping of it (dataBase changes). The
+ * kernel then knows the modified pages and VM_Restore only drops those. If
+ * this is not available, a copy is used.
+ * @param[in,out] vm Pointer to initialized virtual machine (not running).
+ * @param[out] snapshot Saved state. Release with VM_FreeSnapshot.
+ * @param[in] trackPages Track the modified pages instead of copying.
+ * @return 0 if everything is OK. -1 if something went wrong. */
+int VM_Snapshot(vm_t* vm, vmSnapshot_t* snapshot, int trackPages);
+
+/** Reset a virtual machine to the state saved by VM_Snapshot. The snapshot
+ * can be restored several times and also to other instances of the same
+ * module.
+ * @param[in,out] vm Pointer to initialized virtual machine (not running).
+ * @param[in] snapshot State saved by VM_Snapshot.
+ * @return 0 if everything is OK. -1 if something went wrong. */
+int VM_Restore(vm_t* vm, const vmSnapshot_t* snapshot);
+
+/** Release the memory of a snapshot. The vm keeps running on its data.
+ * @param[in] vm Pointer to vm passed to VM_Snapshot (for Com_free).
+ * @param[in,out] snapshot Snapshot set up by VM_Snapshot. */
+void VM_FreeSnapshot(vm_t* vm, vmSnapshot_t* snapshot);
+
 /** Run a function from the virtual machine.
  * Use the command argument to tell the VM what to do.
  * You can supply additional (up to 12) parameters to pass to the bytecode.
@@ -211,6 +445,155 @@ void VM_Free(vm_t* vm);
  * @return Return value of the function call by the VM. */
 intptr_t VM_Call(vm_t* vm, int command, ...);
 
+/** Run a function from the virtual machine with an argument array.
+ * Only the argc arguments are copied to the VM, so this is cheaper than
+ * VM_Call (that always copies MAX_VMMAIN_ARGS arguments).
+ * @param[in] vm Pointer to initialized virtual machine.
+ * @param[in] argc Number of arguments in argv, 1 to MAX_VMMAIN_ARGS.
+ * @param[in] argv Arguments, argv[0] is the command.
+ * @return Return value of the function call by the VM. */
+intptr_t VM_CallArgs(vm_t* vm, int argc, const int* argv);
+
+/** Run vmMain several times in a row, e.g. once for every entity. This is
+ * cheaper than a VM_Call for every item: the calls share one activation of
+ * the interpreter (or the native code) and its setup.
+ * @param[in] vm Pointer to initialized virtual machine.
+ * @param[in] count Number of calls.
+ * @param[in] argc Number of arguments per call, 1 to MAX_VMMAIN_ARGS.
+ * @param[in] argv count * argc arguments: argv[i * argc] is the command of
+ *                 call i, followed by its arguments.
+ * @param[out] results Return value of every call (count entries), can be
+ *                     NULL.
+ * @return 0 if everything is OK. -1 if a call failed (see vm->lastError),
+ *         the remaining results are not written then. */
+int VM_CallBatch(vm_t* vm, int count, int argc, const int* argv,
+                 intptr_t* results);
+
+/** Run a function from the virtual machine without arguments, see
+ * VM_CallArgs. The bytecode must not read more arguments than passed.
+ * @param[in] vm Pointer to initialized virtual machine.
+ * @param[in] command Basic parameter passed to the bytecode.
+ * @return Return value of the function call by the VM. */
+intptr_t VM_Call0(vm_t* vm, int command);
+
+/** VM_Call0 with one argument */
+intptr_t VM_Call1(vm_t* vm, int command, int arg1);
+
+/** VM_Call0 with two arguments */
+intptr_t VM_Call2(vm_t* vm, int command, int arg1, int arg2);
+
+/** VM_Call0 with three arguments */
+intptr_t VM_Call3(vm_t* vm, int command, int arg1, int arg2, int arg3);
+
+/** Register a table of native handlers for the syscalls. OP_CALL with a
+ * negative target calls table[-1 - target].function directly and only
+ * converts the declared number of arguments. Syscalls outside of the table
+ * or without a function still go to the systemCall callback of VM_Create.
+ * Instances use the table of the module at the time of VM_CreateInstance.
+ * @param[in,out] vm Pointer to initialized virtual machine.
+ * @param[in] table Handlers indexed by syscall number (0 based). Not copied,
+ *                  the table must stay valid until VM_Free.
+ * @param[in] count Number of entries in table, 0 to remove the table.
+ * @return 0 if everything is OK. -1 otherwise. */
+int VM_SetSystemCalls(vm_t* vm, const vmSystemCallEntry_t* table, int count);
+
+/** Load the symbols of a .map file written by q3asm -m. The names of the
+ * code segment are used by VM_FindFunction (and for debug output). Replaces
+ * the symbols loaded before. Instances use the symbols of their module.
+ * @param[in,out] vm Pointer to initialized virtual machine (not an
+ *                   instance).
+ * @param[in] map Zero terminated text of the .map file.
+ * @return Number of symbols loaded, -1 on error. */
+int VM_LoadMap(vm_t* vm, const char* map);
+
+/** Look up a function of the bytecode by name, see VM_LoadMap. Resolve a
+ * function once and call it with VM_CallFunction.
+ * @param[in] vm Pointer to initialized virtual machine.
+ * @param[in] name Name of the function in the C source.
+ * @return Instruction number of the function, -1 if there is no such
+ *         function. */
+int VM_FindFunction(const vm_t* vm, const char* name);
+
+/** Call a function of the bytecode directly instead of going through the
+ * command dispatch in vmMain.
+ * @param[in] vm Pointer to initialized virtual machine.
+ * @param[in] function Instruction number from VM_FindFunction. 0 is vmMain.
+ * @param[in] argc Number of arguments in argv, 0 to MAX_VMMAIN_ARGS.
+ * @param[in] argv Arguments of the function, can be NULL if argc is 0.
+ * @return Return value of the function, -1 with VM_PC_OUT_OF_RANGE if
+ *         function is not the entry point of a function. */
+intptr_t VM_CallFunction(vm_t* vm, int function, int argc, const int* argv);
+
+/** Limit the run time of a VM call. A call from the host (VM_Call,
+ * VM_CallArgs, VM_CallFunction, ...) may then pass only limit function
+ * entries and backward jumps. At the next one, the call is suspended: it
+ * returns 0 and vm->suspended is set. VM_Resume continues the call with a
+ * new budget, VM_Abort drops it. The other functions treat a suspended VM
+ * like a running VM, so no other call is possible until then.
+ * The budget is only checked by the interpreter: the native code is not used
+ * while a budget is set. VM_CallBatch and calls from syscalls back into the
+ * VM are never suspended.
+ * @param[in,out] vm Pointer to initialized virtual machine.
+ * @param[in] limit Function entries and backward jumps per call or
+ *                  VM_Resume, 0 or less: no limit (default).
+ * @return 0 if everything is OK. -1 otherwise. */
+int VM_SetBudget(vm_t* vm, int limit);
+
+/** Continue a call that was suspended by the budget of VM_SetBudget.
+ * @param[in,out] vm Pointer to virtual machine with vm->suspended set.
+ * @return Return value of the function if the call has finished. 0 and
+ *         vm->suspended set if the budget was used up again. */
+intptr_t VM_Resume(vm_t* vm);
+
+/** Drop a call that was suspended by the budget of VM_SetBudget. Its stack
+ * is released, the changes of the data segment stay.
+ * @param[in,out] vm Pointer to virtual machine with vm->suspended set.
+ * @return 0 if everything is OK. -1 otherwise. */
+int VM_Abort(vm_t* vm);
+
+/** Switch the profiler on or off. While it is on, the VM counts the calls
+ * and instructions of every function and the executed op codes. The
+ * interpreter runs a copy of the code with a counter in front of every
+ * instruction, so there is no cost if the profiler is off. The native code
+ * is not used while the profiler is on.
+ * @param[in,out] vm Pointer to initialized virtual machine, not running.
+ * @param[in] enable 1: reset the counters and start counting. 0: stop, the
+ *                   results are kept until the next start or VM_Free.
+ * @return 0 if everything is OK. -1 otherwise. */
+int VM_Profile(vm_t* vm, int enable);
+
+/** Results of the profiler.
+ * @param[in] vm Pointer to initialized virtual machine.
+ * @return Counters since the last VM_Profile(vm, 1), NULL if the profiler
+ *         was never started. */
+const vmProfile_t* VM_GetProfile(const vm_t* vm);
+
+/** Let the profiler take a sample of the call stack every interval
+ * instructions. The sampler walks the stack frames of the bytecode, so it
+ * works without DEBUG_VM. Takes effect with the next VM_Profile(vm, 1).
+ * @param[in,out] vm Pointer to initialized virtual machine.
+ * @param[in] interval Number of instructions between two samples, 0 or
+ *                     less: no samples (default).
+ * @return 0 if everything is OK. -1 otherwise. */
+int VM_ProfileSampling(vm_t* vm, int interval);
+
+/** The call stack samples of the profiler in the folded format of flame
+ * graph tools: one line per call stack, the function names from the
+ * outermost call to the sampled function separated by ';', then a space and
+ * the number of samples. E.g. "vmMain;fib;fib 42". Functions without a
+ * symbol from VM_LoadMap are named @ and their instruction number.
+ * @param[in] vm Pointer to virtual machine with a started profiler.
+ * @param[out] buffer Output, always NUL terminated. Can be NULL if size is 0.
+ * @param[in] size Number of bytes in buffer.
+ * @return Length of the complete output without the NUL. If this is not
+ *         smaller than size, the output was cut off. */
+int VM_GetFoldedStacks(const vm_t* vm, char* buffer, int size);
+
+/** Name of an op code, e.g. for the opcodeCount of vmProfile_t.
+ * @param[in] opcode Op code or superinstruction of the interpreter.
+ * @return Name like "OP_ENTER", NULL if there is no such op code. */
+const char* VM_OpcodeName(int opcode);
+
 /** Helper function for syscalls VMA(x) macro:
  * Translate from virtual machine memory to real machine memory.
  * If this is a memory range, use the VM_MemoryRangeValid() function to
@@ -245,11 +628,19 @@ int32_t VM_FloatToInt(float f);
  * @return 0 if valid (!), -1 if invalid. */
 int VM_MemoryRangeValid(intptr_t vmAddr, size_t len, const vm_t* vm);
 
-/** Print call statistics for every function. Only works with DEBUG_VM.
- * Does nothing if DEBUG_VM is not defined.
+/** Print call statistics for every function. With DEBUG_VM: the calls
+ * counted by the debug interpreter. Otherwise: the results of VM_Profile, if
+ * the profiler was started.
  * @param[in] vm VM to profile */
 void VM_VmProfile_f(const vm_t* vm);
 
+/** Print the op code counts of VM_Profile as CSV with the columns
+ * first,second,count. A row with an empty second column is the count of a
+ * single op code, the other rows are the counts of op code pairs. Zero
+ * counts are skipped.
+ * @param[in] vm VM with a started profiler. */
+void VM_OpcodeProfile_f(const vm_t* vm);
+
 /** Set the printf debug level. Only useful with DEBUG_VM.
  * Set to 1 for general informations and 2 to output every opcode name.
  * @param[in] level If level is 0: be quiet (default). */
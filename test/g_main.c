@@ -2,6 +2,7 @@
 #include "bg_lib.h"
 void printf(const char* fmt, ...);
 #else
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #define trap_Error(x) printf("%s\n", x)
@@ -24,6 +25,9 @@ int recursive(int i);
 
 int fib(int n);
 
+/* test the heap functions with a heap of 256 bytes, 0 if it works */
+int heapTest(void);
+
 volatile int        bssTest;         /* don't initialize, should be zero */
 volatile static int dataTest = -999; /* don't change, should be 999 */
 
@@ -83,6 +87,12 @@ int vmMain(int command, int arg0, int arg1, int arg2, int arg3, int arg4,
         printf("Invalid function pointer accepted.\n");
         return 0x0badf00d;
     }
+#ifdef Q3_VM
+    if (command == 3)
+    {
+        return heapTest();
+    }
+#endif
 
     printf(str, "World");
     trap_Error("Testing Error Callback\n");
@@ -323,6 +333,14 @@ int vmMain(int command, int arg0, int arg1, int arg2, int arg3, int arg4,
             return -1;
         }
         printf("passed\n");
+
+        printf("Math system call test: ");
+        if (sqrt(6.25f) != 2.5f || floor(-2.5f) != -3.0f)
+        {
+            printf("failed\n");
+            return -1;
+        }
+        printf("passed\n");
     }
 
     printf("fib(17) = ");
@@ -383,6 +401,48 @@ int recursive(int i)
     return vmMain(1, i, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
 }
 #else
+int heapTest(void)
+{
+    char* p;
+    char* q;
+    int   mark;
+
+    p    = malloc(100);
+    mark = heapmark();
+    q    = malloc(100);
+    if (!p || !q || q - p != 112 || ((int)p & 15))
+    {
+        return 1;
+    }
+    if (malloc(100)) /* the heap is full */
+    {
+        return 2;
+    }
+    heapreset(mark);
+    if (malloc(100) != q)
+    {
+        return 3;
+    }
+    p[99] = 1;
+    heapfreeall();
+    q = calloc(25, 4);
+    if (q != p || q[99] != 0)
+    {
+        return 4;
+    }
+    /* an unaligned mark is ignored */
+    heapfreeall();
+    p = malloc(16);
+    heapreset((int)p + 1);
+    q = malloc(240);
+    if (q != p + 16 || malloc(1))
+    {
+        return 5;
+    }
+    heapfreeall();
+    return 0;
+}
+
 void printf(const char* fmt, ...)
 {
     va_list argptr;
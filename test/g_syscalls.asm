@@ -7,4 +7,10 @@ equ	memcpy					-4
 equ	badcall					-5
 equ	floatff					-6
 equ	recursive				-7
+equ	sqrt					-8
+equ	floor					-9
+equ	malloc					-10
+equ	heapmark				-11
+equ	heapreset				-12
+equ	heapfreeall				-13
 
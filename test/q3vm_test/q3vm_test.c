@@ -9,11 +9,20 @@
    Quake III Arena Virtual Machine
 */
 
+#define _POSIX_C_SOURCE 200112L /* mmap with -std=c99 */
 #include "vm.h"
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static int g_mallocFail = -1; /* if this is not -1, malloc will fail */
+static int g_interpreted = 0; /* if this is 1, the JIT is not used */
+static int g_hostMathCalls = 0; /* SQRT and FLOOR calls of systemCalls() */
 
 /* The compiled bytecode calls native functions,
    defined in this file. */
@@ -23,6 +32,26 @@ intptr_t systemCalls(vm_t* vm, intptr_t* args);
    Call free() to unload image. */
 uint8_t* loadImage(const char* filepath, int* size);
 
+/* Load the bytecode from filepath and create a VM with options, NULL for
+   the defaults. Returns 0 on success, -1 on error. */
+static int createTestVm(vm_t* vm, const char* filepath,
+                        const vmCreateOptions_t* options)
+{
+    int      imageSize;
+    int      retVal;
+    uint8_t* image = loadImage(filepath, &imageSize);
+
+    if (!image)
+    {
+        return -1;
+    }
+    retVal = VM_CreateWithOptions(vm, filepath, image, imageSize, systemCalls,
+                                  options);
+    free(image);
+
+    return retVal;
+}
+
 int testInject(const char* filepath, int offset, int opcode)
 {
     vm_t     vm;
@@ -62,6 +91,11 @@ int testNominal(const char* filepath)
     VM_Debug(1);
     if (VM_Create(&vm, filepath, image, imageSize, systemCalls) == 0)
     {
+        if (g_interpreted)
+        {
+            vm.compiled = 0;
+        }
+        printf("Running %s\n", vm.compiled ? "native code" : "interpreter");
         /* normal call, should give us 0 */
         retVal = VM_Call(&vm, 0);
         /* now do the proper call, this should give us 333 */
@@ -70,6 +104,31 @@ int testNominal(const char* filepath)
         printf("Result (should be 333): %i\n", retVal);
         /* now do an invalid function call within the VM */
         retVal += (VM_Call(&vm, 2)+1); /* we expect a -1, so we add a +1 to cancel it out */
+        /* test.qvm has plenty of sequences for superinstructions */
+        printf("Superinstructions: %i\n", vm.fusionCount);
+        if (vm.fusionCount < 1)
+        {
+            retVal = -1;
+        }
+        /* fixed-arity calls: command 1 returns its first argument */
+        const int args[3] = { 1, 9, 0 };
+        VM_Call0(&vm, 1);
+        if (VM_Call1(&vm, 1, 5) != 5 || VM_Call2(&vm, 1, 6, 0) != 6 ||
+            VM_Call3(&vm, 1, 7, 0, 0) != 7 || VM_CallArgs(&vm, 3, args) != 9 ||
+            VM_CallArgs(&vm, 0, args) != -1 ||
+            VM_CallArgs(&vm, MAX_VMMAIN_ARGS + 1, args) != -1)
+        {
+            retVal = -1;
+        }
+        /* three calls of command 1 in one batch */
+        const int batch[6] = { 1, 3, 1, 4, 1, 5 };
+        intptr_t  results[3];
+        if (VM_CallBatch(&vm, 3, 2, batch, results) != 0 || results[0] != 3 ||
+            results[1] != 4 || results[2] != 5 ||
+            VM_CallBatch(&vm, 3, 0, batch, results) != -1)
+        {
+            retVal = -1;
+        }
     }
     VM_VmProfile_f(&vm);
     VM_Free(&vm);
@@ -87,6 +146,848 @@ int testNominal(const char* filepath)
     }
 }
 
+/* Create a VM from a tiny handcrafted function:
+   OP_ENTER 8, OP_CONST 7, (optional: OP_CONST 8), OP_LEAVE leaveFrame */
+int testVerifier(int leaveFrame, int extraConst)
+{
+    vm_t    vm;
+    uint8_t image[sizeof(vmHeader_t) + 20] = { 0 };
+    uint8_t code[] = { 3, 8, 0, 0, 0, 8, 7, 0, 0, 0, 8, 8, 0, 0, 0,
+                       4, (uint8_t)leaveFrame, 0, 0, 0 };
+    vmHeader_t* header = (vmHeader_t*)image;
+    int         codeLength = sizeof(code);
+    int         verified;
+
+    if (!extraConst) /* remove the second OP_CONST */
+    {
+        memmove(&code[10], &code[15], 5);
+        codeLength -= 5;
+    }
+    header->vmMagic          = VM_MAGIC;
+    header->instructionCount = extraConst ? 4 : 3;
+    header->codeOffset       = sizeof(vmHeader_t);
+    header->codeLength       = codeLength;
+    header->dataOffset       = sizeof(vmHeader_t) + codeLength;
+    header->bssLength        = 0x20000;
+    memcpy(&image[sizeof(vmHeader_t)], code, codeLength);
+
+    if (VM_Create(&vm, "verifier", image, sizeof(image), systemCalls) != 0)
+    {
+        return -1;
+    }
+    verified = vm.verified;
+    if (verified && VM_Call(&vm, 0) != 7)
+    {
+        verified = -1;
+    }
+    VM_Free(&vm);
+    return verified;
+}
+
+/* Create a VM from a handcrafted function that returns the int at the
+   address of its argument: OP_ENTER 8, OP_LOCAL 16, OP_LOAD4, OP_LOAD4,
+   OP_LEAVE 8. An address out of range is masked, or with guard pages
+   (dataMask -1) the call fails with VM_DATA_OUT_OF_RANGE. */
+int testDataAccess(void)
+{
+    vm_t    vm;
+    uint8_t image[sizeof(vmHeader_t) + 17] = { 0 };
+    const uint8_t code[] = { 3, 8, 0, 0, 0, 9, 16, 0, 0, 0, 29, 29,
+                             4, 8, 0, 0, 0 };
+    vmHeader_t* header = (vmHeader_t*)image;
+    int         retVal = 0;
+    int         interpreted;
+
+    header->vmMagic          = VM_MAGIC;
+    header->instructionCount = 5;
+    header->codeOffset       = sizeof(vmHeader_t);
+    header->codeLength       = sizeof(code);
+    header->dataOffset       = sizeof(vmHeader_t) + sizeof(code);
+    header->bssLength        = 0x20000;
+    memcpy(&image[sizeof(vmHeader_t)], code, sizeof(code));
+
+    if (VM_Create(&vm, "data", image, sizeof(image), systemCalls) != 0)
+    {
+        return -1;
+    }
+    for (interpreted = 0; interpreted < 2; interpreted++)
+    {
+        vm.compiled   = vm.compiled && !interpreted;
+        vm.lastError  = VM_NO_ERROR;
+        const int r   = (int)VM_Call(&vm, 0x7ffffff0);
+        const int err = vm.lastError;
+        if ((vm.dataMask == -1) ? (r != -1 || err != VM_DATA_OUT_OF_RANGE)
+                                : (err != VM_NO_ERROR))
+        {
+            retVal = -1;
+        }
+        /* the vm can still be used */
+        *(int*)&vm.dataBase[16] = 42;
+        if (VM_Call(&vm, 16) != 42 || vm.programStack != vm.dataLength)
+        {
+            retVal = -1;
+        }
+    }
+    if ((uint8_t*)VM_ArgPtr(0x7ffffff0, &vm) >= vm.dataBase + vm.dataLength ||
+        VM_MemoryRangeValid(16, vm.dataLength - 16, &vm) != 0 ||
+        VM_MemoryRangeValid(16, vm.dataLength - 15, &vm) == 0)
+    {
+        retVal = -1;
+    }
+    VM_Free(&vm);
+    return retVal;
+}
+
+#define TEST_INSTANCES 4 /* number of threads for testInstances */
+
+static void* instanceThread(void* arg)
+{
+    vm_t*    vm = (vm_t*)arg;
+    intptr_t i;
+
+    for (i = 0; i < 10000; i++)
+    {
+        /* command 1 returns the argument */
+        if (VM_Call(vm, 1, (int)i) != i)
+        {
+            return vm;
+        }
+    }
+    return NULL;
+}
+
+/* Run several instances of one module in parallel threads */
+int testInstances(const char* filepath)
+{
+    vm_t      module;
+    vm_t      instances[TEST_INSTANCES];
+    pthread_t threads[TEST_INSTANCES];
+    void*     threadResult;
+    int       i;
+    int       retVal = 0;
+
+    /* the instances don't need the bytecode */
+    if (createTestVm(&module, filepath, NULL) != 0)
+    {
+        return -1;
+    }
+
+    VM_CreateInstance(NULL, &module);
+    VM_CreateInstance(&module, &module);
+    for (i = 0; i < TEST_INSTANCES; i++)
+    {
+        if (VM_CreateInstance(&instances[i], &module) != 0)
+        {
+            retVal = -1;
+        }
+        /* the instances must not share the data segment */
+        if (instances[i].dataBase == module.dataBase ||
+            instances[i].codeBase != module.codeBase)
+        {
+            retVal = -1;
+        }
+    }
+    if (retVal == 0)
+    {
+        for (i = 0; i < TEST_INSTANCES; i++)
+        {
+            pthread_create(&threads[i], NULL, instanceThread, &instances[i]);
+        }
+        for (i = 0; i < TEST_INSTANCES; i++)
+        {
+            pthread_join(threads[i], &threadResult);
+            if (threadResult)
+            {
+                retVal = -1;
+            }
+        }
+    }
+    /* a new instance starts with the initial data, even if the others
+       wrote to their (copy-on-write) data segments */
+    VM_Free(&instances[0]);
+    if (VM_CreateInstance(&instances[0], &module) != 0 ||
+        memcmp(instances[0].dataBase, module.dataBase, module.dataAlloc) != 0)
+    {
+        retVal = -1;
+    }
+    VM_Free(&instances[0]);
+    for (i = 0; i < TEST_INSTANCES; i++)
+    {
+        VM_Free(&instances[i]);
+    }
+    VM_Free(&module);
+
+    return retVal;
+}
+
+/* Create a VM with a smaller stack and a heap, and with invalid options */
+int testCreateOptions(const char* filepath)
+{
+    vm_t              vm;
+    vm_t              instance;
+    vmCreateOptions_t options;
+    uint8_t*          image;
+    int               imageSize;
+    int               retVal = 0;
+
+    memset(&options, 0, sizeof(options));
+    options.stackSize = 0x4000;
+    options.heapSize  = 1000;
+    if (createTestVm(&vm, filepath, &options) != 0)
+    {
+        return -1;
+    }
+    if (vm.stackSize != 0x4000 || vm.heapLength != 1008 ||
+        (vm.heapBase & 15) || vm.stackBottom != vm.dataLength - 0x4000 ||
+        vm.heapBase + vm.heapLength > vm.stackBottom ||
+        VM_Call(&vm, 1, 5) != 5)
+    {
+        retVal = -1;
+    }
+    if (VM_CreateInstance(&instance, &vm) != 0 ||
+        instance.heapBase != vm.heapBase ||
+        instance.stackBottom != vm.stackBottom || VM_Call(&instance, 1, 6) != 6)
+    {
+        retVal = -1;
+    }
+    VM_Free(&instance);
+    VM_Free(&vm);
+
+    /* a negative or too small stack and a too small image limit fail */
+    options.stackSize = -4;
+    if (createTestVm(&vm, filepath, &options) == 0 ||
+        vm.lastError != VM_INVALID_OPTIONS)
+    {
+        retVal = -1;
+    }
+    options.stackSize = 16;
+    if (createTestVm(&vm, filepath, &options) == 0)
+    {
+        retVal = -1;
+    }
+    options.stackSize    = 0;
+    options.maxImageSize = VM_MAX_DATA_LENGTH + 1;
+    if (createTestVm(&vm, filepath, &options) == 0 ||
+        vm.lastError != VM_INVALID_OPTIONS)
+    {
+        retVal = -1;
+    }
+
+    /* an image one byte over the limit fails */
+    image = loadImage(filepath, &imageSize);
+    if (!image)
+    {
+        return -1;
+    }
+    options.maxImageSize = imageSize - 1;
+    if (VM_CreateWithOptions(&vm, filepath, image, imageSize, systemCalls,
+                             &options) == 0)
+    {
+        retVal = -1;
+    }
+    /* section lengths that overflow an int are a bad header */
+    ((vmHeader_t*)image)->dataLength = 0x7ffffff0;
+    ((vmHeader_t*)image)->litLength  = 0x7ffffff0;
+    if (VM_Create(&vm, filepath, image, imageSize, systemCalls) == 0)
+    {
+        retVal = -1;
+    }
+    VM_Free(&vm);
+    free(image);
+
+    return retVal;
+}
+
+/* A pooled VM gets the buffers of the last pooled VM back, cleared */
+int testPool(const char* filepath)
+{
+    vm_t              vm;
+    vmCreateOptions_t options;
+    intptr_t*         instructionPointers;
+    int               i;
+    int               retVal = 0;
+
+    memset(&options, 0, sizeof(options));
+    options.pooled = 1;
+    for (i = 0; i < 2; i++)
+    {
+        if (createTestVm(&vm, filepath, &options) != 0)
+        {
+            return -1;
+        }
+        /* bssTest must be 0 and dataTest -999 for the second VM, too */
+        if (VM_Call(&vm, 0) != 0)
+        {
+            retVal = -1;
+        }
+        if (i == 0)
+        {
+            instructionPointers = vm.instructionPointers;
+            memset(vm.dataBase, 0x55, vm.dataLength);
+        }
+        else if (vm.instructionPointers != instructionPointers)
+        {
+            retVal = -1;
+        }
+        VM_Free(&vm);
+    }
+    VM_ReleasePool();
+    VM_ReleasePool();
+
+    return retVal;
+}
+
+/* Two VMs of the same bytecode share the prepared code (code cache) */
+int testCodeCache(const char* filepath)
+{
+    vm_t vm1;
+    vm_t vm2;
+    int  retVal = 0;
+
+    if (createTestVm(&vm1, filepath, NULL) != 0)
+    {
+        return -1;
+    }
+    if (createTestVm(&vm2, filepath, NULL) != 0)
+    {
+        VM_Free(&vm1);
+        return -1;
+    }
+
+    if (vm1.codeImage != vm2.codeImage ||
+        (vm1.codeImage && (vm1.codeBase != vm2.codeBase ||
+                           vm1.instructionPointers != vm2.instructionPointers)))
+    {
+        retVal = -1;
+    }
+    /* the code stays valid for vm2 */
+    VM_Free(&vm1);
+    if (VM_Call(&vm2, 1, 5) != 5)
+    {
+        retVal = -1;
+    }
+    VM_Free(&vm2);
+
+    return retVal;
+}
+
+/* Load the .map file of q3asm next to the .qvm file.
+   Call free() to unload the text. */
+static char* loadMap(const char* filepath)
+{
+    char  mapPath[256];
+    char* map;
+    char* ext;
+    int   size;
+
+    snprintf(mapPath, sizeof(mapPath), "%s", filepath);
+    ext = strrchr(mapPath, '.');
+    if (ext)
+    {
+        strcpy(ext, ".map");
+    }
+    map = (char*)loadImage(mapPath, &size);
+    if (!map)
+    {
+        return NULL;
+    }
+    map       = (char*)realloc(map, size + 1);
+    map[size] = 0;
+    return map;
+}
+
+/* Load the .map file next to filepath into vm.
+   Returns the instruction number of fib(), -1 if it is not found. */
+static int findFib(vm_t* vm, const char* filepath)
+{
+    char* map = loadMap(filepath);
+
+    if (map)
+    {
+        VM_LoadMap(vm, map);
+        free(map);
+    }
+    return VM_FindFunction(vm, "fib");
+}
+
+/* Call fib() of the bytecode directly, the name is resolved with the .map
+   file */
+int testFunctions(const char* filepath)
+{
+    vm_t  vm;
+    vm_t  instance;
+    char* map;
+    int   fib;
+    int   n      = 17;
+    int   retVal = 0;
+
+    if (createTestVm(&vm, filepath, NULL) != 0)
+    {
+        return -1;
+    }
+
+    map = loadMap(filepath);
+    if (!map)
+    {
+        VM_Free(&vm);
+        return -1;
+    }
+
+    VM_LoadMap(NULL, map);
+    if (VM_LoadMap(&vm, map) < 1 || VM_LoadMap(&vm, map) < 1)
+    {
+        retVal = -1;
+    }
+    free(map);
+
+    fib = VM_FindFunction(&vm, "fib");
+    if (fib <= 0 || VM_FindFunction(&vm, "vmMain") != 0 ||
+        VM_FindFunction(&vm, "trap_Printf") != -1 || /* a syscall */
+        VM_FindFunction(&vm, "dataTest") != -1 ||    /* data segment */
+        VM_FindFunction(&vm, "foobar") != -1 ||
+        VM_FindFunction(&vm, NULL) != -1)
+    {
+        retVal = -1;
+    }
+    if (VM_CallFunction(&vm, fib, 1, &n) != 1597)
+    {
+        retVal = -1;
+    }
+    if (VM_CallFunction(&vm, -1, 0, NULL) != -1 ||
+        vm.lastError != VM_PC_OUT_OF_RANGE ||
+        VM_CallFunction(&vm, fib + 1, 1, &n) != -1 || /* after OP_ENTER */
+        vm.lastError != VM_PC_OUT_OF_RANGE ||
+        VM_CallFunction(&vm, fib, -1, &n) != -1 ||
+        vm.lastError != VM_BAD_ARGUMENT_COUNT)
+    {
+        retVal = -1;
+    }
+
+    /* an instance uses the symbols of the module */
+    if (VM_CreateInstance(&instance, &vm) != 0 ||
+        VM_FindFunction(&instance, "fib") != fib ||
+        VM_LoadMap(&instance, "0 0 vmMain") != -1 ||
+        VM_CallFunction(&instance, fib, 1, &n) != 1597)
+    {
+        retVal = -1;
+    }
+    VM_Free(&instance);
+
+    vm.compiled = 0; /* same result without the JIT */
+    if (VM_CallFunction(&vm, fib, 1, &n) != 1597)
+    {
+        retVal = -1;
+    }
+    VM_Free(&vm);
+
+    return retVal;
+}
+
+static int g_floatffCalls = 0; /* calls of the registered floatff handler */
+
+/* Registered handler for FLOATFF (-6) */
+static intptr_t testFloatff(vm_t* vm, intptr_t* args)
+{
+    (void)vm;
+    g_floatffCalls++;
+    return VM_FloatToInt(VMF(1) * 2.0f);
+}
+
+/* Handlers and intrinsics of the syscalls of the test bytecode */
+static const vmSystemCallEntry_t g_systemCallTable[] = {
+    {NULL, 0, VM_INTRINSIC_NONE},        /* -1: PRINTF, by systemCalls() */
+    {NULL, 0, VM_INTRINSIC_NONE},        /* -2: ERROR */
+    {NULL, 0, VM_INTRINSIC_MEMSET},      /* -3: MEMSET */
+    {NULL, 0, VM_INTRINSIC_MEMCPY},      /* -4: MEMCPY */
+    {NULL, 0, VM_INTRINSIC_NONE},        /* -5: BADCALL */
+    {testFloatff, 1, VM_INTRINSIC_NONE}, /* -6: FLOATFF */
+    {NULL, 0, VM_INTRINSIC_NONE},        /* -7: RECURSIVE */
+    {NULL, 0, VM_INTRINSIC_SQRT},        /* -8: SQRT */
+    {NULL, 0, VM_INTRINSIC_FLOOR},       /* -9: FLOOR */
+    {NULL, 0, VM_INTRINSIC_MALLOC},      /* -10: MALLOC */
+    {NULL, 0, VM_INTRINSIC_HEAPMARK},    /* -11: HEAPMARK */
+    {NULL, 0, VM_INTRINSIC_HEAPRESET},   /* -12: HEAPRESET */
+    {NULL, 0, VM_INTRINSIC_HEAPFREEALL}, /* -13: HEAPFREEALL */
+};
+#define TEST_SYSTEM_CALLS                                                      \
+    ((int)(sizeof(g_systemCallTable) / sizeof(g_systemCallTable[0])))
+
+/* Syscalls with a table of handlers and intrinsics (VM_SetSystemCalls) */
+int testSystemCallTable(const char* filepath)
+{
+    const vmSystemCallEntry_t badTable[] = {
+        {testFloatff, MAX_VMSYSCALL_ARGS, VM_INTRINSIC_NONE},
+        {NULL, 0, VM_INTRINSIC_MAX},
+    };
+    vm_t     vm;
+    intptr_t expected;
+    int      hostMathCalls;
+    int      retVal = 0;
+
+    if (createTestVm(&vm, filepath, NULL) != 0)
+    {
+        return -1;
+    }
+
+    expected = VM_Call(&vm, 0, 0, 1);
+    if (VM_SetSystemCalls(NULL, g_systemCallTable, TEST_SYSTEM_CALLS) != -1 ||
+        VM_SetSystemCalls(&vm, NULL, TEST_SYSTEM_CALLS) != -1 ||
+        VM_SetSystemCalls(&vm, &badTable[0], 1) != -1 ||
+        VM_SetSystemCalls(&vm, &badTable[1], 1) != -1 ||
+        VM_SetSystemCalls(&vm, g_systemCallTable, TEST_SYSTEM_CALLS) != 0)
+    {
+        retVal = -1;
+    }
+    /* misbehave mode runs the float and math system call tests of the
+       bytecode, the math functions don't reach the host anymore */
+    hostMathCalls = g_hostMathCalls;
+    if (VM_Call(&vm, 0, 0, 1) != expected || g_floatffCalls < 1 ||
+        g_hostMathCalls != hostMathCalls)
+    {
+        retVal = -1;
+    }
+    VM_Free(&vm);
+
+    return retVal;
+}
+
+/* Run the heap test of the bytecode (command 3) with the heap intrinsics */
+int testHeap(const char* filepath)
+{
+    vmCreateOptions_t options;
+    vm_t              vm;
+    vm_t              instance;
+    int               retVal = 0;
+
+    memset(&options, 0, sizeof(options));
+    options.heapSize = 256;
+    if (createTestVm(&vm, filepath, &options) != 0)
+    {
+        return -1;
+    }
+    VM_SetSystemCalls(&vm, g_systemCallTable, TEST_SYSTEM_CALLS);
+    if (VM_Call(&vm, 3) != 0 || vm.heapTop != vm.heapBase)
+    {
+        retVal = -1;
+    }
+    vm.compiled = 0;
+    if (VM_Call(&vm, 3) != 0)
+    {
+        retVal = -1;
+    }
+    if (VM_CreateInstance(&instance, &vm) != 0 ||
+        instance.heapTop != instance.heapBase || VM_Call(&instance, 3) != 0)
+    {
+        retVal = -1;
+    }
+    VM_Free(&instance);
+    VM_Free(&vm);
+
+    /* without a heap malloc returns NULL */
+    if (createTestVm(&vm, filepath, NULL) != 0)
+    {
+        return -1;
+    }
+    VM_SetSystemCalls(&vm, g_systemCallTable, TEST_SYSTEM_CALLS);
+    if (VM_Call(&vm, 3) != 1)
+    {
+        retVal = -1;
+    }
+    VM_Free(&vm);
+
+    return retVal;
+}
+
+/* Count the instructions of VM_Call(&vm, 0) with the profiler */
+int testProfile(const char* filepath)
+{
+    vm_t               vm;
+    const vmProfile_t* profile;
+    uint64_t           instructions;
+    uint64_t           exclusive = 0;
+    uint64_t           pairs     = 0;
+    char               stacks[4096];
+    char               shortStacks[8];
+    int                fib;
+    int                fibCalls  = 0;
+    int                i;
+    int                retVal = 0;
+
+    if (createTestVm(&vm, filepath, NULL) != 0)
+    {
+        return -1;
+    }
+    fib = findFib(&vm, filepath);
+
+    vm.callLevel = 1; /* not while the VM is running */
+    if (VM_Profile(&vm, 1) != -1 || VM_GetProfile(&vm) != NULL)
+    {
+        retVal = -1;
+    }
+    vm.callLevel = 0;
+
+    if (VM_ProfileSampling(&vm, 97) != 0 || VM_Profile(&vm, 1) != 0 ||
+        VM_Call(&vm, 0) != 0)
+    {
+        retVal = -1;
+    }
+    VM_Profile(&vm, 0);
+    profile = VM_GetProfile(&vm);
+    if (!profile || profile->instructions == 0 || profile->numFunctions < 2)
+    {
+        VM_Free(&vm);
+        return -1;
+    }
+    for (i = 0; i < profile->numFunctions; i++)
+    {
+        exclusive += profile->functions[i].exclusive;
+    }
+    /* vmMain runs everything, fib(17) has 2 * 1597 - 1 calls */
+    if (exclusive != profile->instructions ||
+        profile->functions[0].calls != 1 ||
+        profile->functions[0].inclusive != profile->instructions ||
+        profile->opcodeCount[3 /* OP_ENTER */] < 3193)
+    {
+        retVal = -1;
+    }
+    for (i = 0; i < profile->numFunctions; i++)
+    {
+        if (profile->functions[i].function == fib &&
+            profile->functions[i].name &&
+            strcmp(profile->functions[i].name, "fib") == 0)
+        {
+            fibCalls = (int)profile->functions[i].calls;
+        }
+    }
+    if (fibCalls != 3193)
+    {
+        retVal = -1;
+    }
+    /* OP_ENTER is never the last instruction, so every one has a successor */
+    for (i = 0; i < VM_OPCODE_COUNT; i++)
+    {
+        pairs += profile->opcodePairs[3 /* OP_ENTER */][i];
+    }
+    if (pairs != profile->opcodeCount[3] ||
+        strcmp(VM_OpcodeName(3), "OP_ENTER") != 0 ||
+        VM_OpcodeName(-1) != NULL || VM_OpcodeName(VM_OPCODE_COUNT) != NULL)
+    {
+        retVal = -1;
+    }
+    VM_VmProfile_f(&vm);
+    VM_OpcodeProfile_f(&vm);
+
+    /* a sample every 97 instructions, the recursion of fib is visible */
+    if (profile->samples == 0 || profile->samples > profile->instructions / 97 ||
+        VM_GetFoldedStacks(&vm, stacks, sizeof(stacks)) >= (int)sizeof(stacks) ||
+        strstr(stacks, "\nvmMain;fib;fib;fib ") == NULL ||
+        VM_GetFoldedStacks(&vm, shortStacks, sizeof(shortStacks)) !=
+            (int)strlen(stacks) ||
+        strlen(shortStacks) != sizeof(shortStacks) - 1)
+    {
+        retVal = -1;
+    }
+    printf("%s", stacks);
+
+    /* stopped: the results stay */
+    instructions = profile->instructions;
+    if (VM_Call(&vm, 0) != 0 || profile->instructions != instructions)
+    {
+        retVal = -1;
+    }
+    VM_Free(&vm);
+
+    return retVal;
+}
+
+/* Run vmMain and fib in slices with VM_SetBudget */
+int testBudget(const char* filepath)
+{
+    vm_t               vm;
+    const vmProfile_t* profile;
+    intptr_t           r;
+    int                fib;
+    int                arg    = 17;
+    int                slices = 0;
+    int                i;
+    int                retVal = 0;
+
+    if (createTestVm(&vm, filepath, NULL) != 0)
+    {
+        return -1;
+    }
+    fib = findFib(&vm, filepath);
+
+    /* the loop of vmMain runs in many slices */
+    if (VM_SetBudget(&vm, 100000) != 0)
+    {
+        retVal = -1;
+    }
+    r = VM_Call(&vm, 0);
+    while (vm.suspended && slices < 1000000)
+    {
+        /* nothing else runs on a suspended VM */
+        if (slices == 0 && (VM_CallFunction(&vm, fib, 1, &arg) != -1 ||
+                            VM_Profile(&vm, 1) != -1))
+        {
+            retVal = -1;
+        }
+        slices++;
+        r = VM_Resume(&vm);
+    }
+    if (r != 0 || slices < 100 || vm.callLevel != 0)
+    {
+        retVal = -1;
+    }
+
+    /* every call of fib is a budget point, also with the profiler */
+    VM_SetBudget(&vm, 100);
+    VM_Profile(&vm, 1);
+    slices = 0;
+    r      = VM_CallFunction(&vm, fib, 1, &arg);
+    while (vm.suspended && slices < 1000000)
+    {
+        slices++;
+        r = VM_Resume(&vm);
+    }
+    VM_Profile(&vm, 0);
+    profile = VM_GetProfile(&vm);
+    if (r != 1597 || slices < 3193 / 100 || !profile)
+    {
+        retVal = -1;
+    }
+    for (i = 0; profile && i < profile->numFunctions; i++)
+    {
+        if (profile->functions[i].function == fib &&
+            profile->functions[i].calls != 3193)
+        {
+            retVal = -1;
+        }
+    }
+
+    /* nothing to resume */
+    if (VM_Resume(&vm) != -1 || VM_Abort(&vm) != -1 ||
+        VM_Resume(NULL) != -1 || VM_Abort(NULL) != -1)
+    {
+        retVal = -1;
+    }
+
+    /* drop a suspended call */
+    VM_CallFunction(&vm, fib, 1, &arg);
+    if (!vm.suspended || VM_Abort(&vm) != 0 || vm.callLevel != 0)
+    {
+        retVal = -1;
+    }
+
+    /* no limit */
+    VM_SetBudget(&vm, 0);
+    if (VM_CallFunction(&vm, fib, 1, &arg) != 1597 || vm.suspended)
+    {
+        retVal = -1;
+    }
+
+    /* free a VM with a suspended call */
+    VM_SetBudget(&vm, 10);
+    VM_CallFunction(&vm, fib, 1, &arg);
+    if (!vm.suspended || VM_SetBudget(NULL, 10) != -1)
+    {
+        retVal = -1;
+    }
+    VM_Free(&vm);
+
+    return retVal;
+}
+
+/* VM_Create with a read-only mapping of the .qvm file, unmapped right after
+   VM_Create */
+int testReadOnlyImage(const char* filepath)
+{
+    vm_t        vm;
+    struct stat st;
+    void*       image;
+    int         retVal = -1;
+    int         fd     = open(filepath, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+    {
+        return -1;
+    }
+    if (VM_Create(&vm, filepath, image, st.st_size, systemCalls) == 0)
+    {
+        munmap(image, st.st_size);
+        retVal = (VM_Call(&vm, 1, 7) == 7) ? 0 : -1;
+        VM_Free(&vm);
+    }
+    else
+    {
+        munmap(image, st.st_size);
+    }
+    return retVal;
+}
+
+/* Modify the data segment and reset it with VM_Restore */
+int testSnapshot(const char* filepath, int trackPages)
+{
+    vm_t         vm;
+    vm_t         other = { 0 };
+    vmSnapshot_t snapshot;
+    uint8_t*     saved;
+    int          savedLength;
+    int          retVal = 0;
+
+    if (createTestVm(&vm, filepath, NULL) != 0)
+    {
+        return -1;
+    }
+
+    VM_Snapshot(NULL, &snapshot, trackPages);
+    VM_Snapshot(&other, &snapshot, trackPages);
+    if (VM_Snapshot(&vm, &snapshot, trackPages) != 0)
+    {
+        VM_Free(&vm);
+        return -1;
+    }
+    savedLength = snapshot.dataLength;
+    saved       = malloc(savedLength);
+    memcpy(saved, vm.dataBase, savedLength);
+
+    /* two rounds: the snapshot can be restored more than once */
+    for (int i = 0; i < 2 && retVal == 0; i++)
+    {
+        memset(vm.dataBase, 0x55 + i, savedLength);
+        if (VM_Call(&vm, 1, 42) != 42 || VM_Restore(&vm, &snapshot) != 0 ||
+            memcmp(saved, vm.dataBase, savedLength) != 0)
+        {
+            retVal = -1;
+        }
+    }
+
+    VM_Restore(NULL, &snapshot);
+    VM_Restore(&other, &snapshot);
+    VM_FreeSnapshot(&vm, &snapshot);
+    VM_FreeSnapshot(&vm, NULL);
+    /* the data of the vm is still valid without the snapshot */
+    if (memcmp(saved, vm.dataBase, savedLength) != 0)
+    {
+        retVal = -1;
+    }
+    free(saved);
+    VM_Free(&vm);
+
+    return retVal;
+}
+
 void testArguments(void)
 {
     vm_t vm = { 0 };
@@ -142,8 +1043,12 @@ int main(int argc, char** argv)
 
     testArguments();
     /* <malloc fail tests> */
-    for (int i = 0; i < VM_ALLOC_TYPE_MAX - 1; i++)
+    for (int i = 0; i < VM_ALLOC_TYPE_MAX; i++)
     {
+        if (i == VM_ALLOC_DEBUG)
+        {
+            continue; /* only the DEBUG_VM build allocates at load time */
+        }
         g_mallocFail = i;
         testNominal(file);
     }
@@ -156,6 +1061,79 @@ int main(int argc, char** argv)
     testInject(file, 32, 63);
     testInject(file, 32, 65);
     testInject(file, 4, -1);
+    if (testVerifier(8, 0) != 1 || testVerifier(12, 0) != 0 ||
+        testVerifier(8, 1) != 0)
+    {
+        printf("Verifier test failed\n");
+        return -1;
+    }
+    if (testDataAccess() != 0)
+    {
+        printf("Data access test failed\n");
+        return -1;
+    }
+    if (testInstances(file) != 0)
+    {
+        printf("Instance test failed\n");
+        return -1;
+    }
+    if (testCreateOptions(file) != 0)
+    {
+        printf("Create options test failed\n");
+        return -1;
+    }
+    if (testPool(file) != 0)
+    {
+        printf("Pool test failed\n");
+        return -1;
+    }
+    if (testCodeCache(file) != 0)
+    {
+        printf("Code cache test failed\n");
+        return -1;
+    }
+    if (testReadOnlyImage(file) != 0)
+    {
+        printf("Read-only image test failed\n");
+        return -1;
+    }
+    if (testFunctions(file) != 0)
+    {
+        printf("Function call test failed\n");
+        return -1;
+    }
+    if (testSystemCallTable(file) != 0)
+    {
+        printf("System call table test failed\n");
+        return -1;
+    }
+    if (testHeap(file) != 0)
+    {
+        printf("Heap test failed\n");
+        return -1;
+    }
+    if (testProfile(file) != 0)
+    {
+        printf("Profiler test failed\n");
+        return -1;
+    }
+    if (testBudget(file) != 0)
+    {
+        printf("Budget test failed\n");
+        return -1;
+    }
+    if (testSnapshot(file, 0) != 0 || testSnapshot(file, 1) != 0)
+    {
+        printf("Snapshot test failed\n");
+        return -1;
+    }
+    /* run the interpreter even if the JIT is available */
+    g_interpreted = 1;
+    if (testNominal(file) != 0)
+    {
+        return -1;
+    }
+    g_interpreted = 0;
     /* finally: test the normal case */
     return testNominal(file);
 }
@@ -267,6 +1245,14 @@ intptr_t systemCalls(vm_t* vm, intptr_t* args)
     case -7: /* RECURSIVE */
         return VM_Call(vm, 1, args[1]);
 
+    case -8: /* SQRT */
+        g_hostMathCalls++;
+        return VM_FloatToInt(sqrtf(VMF(1)));
+
+    case -9: /* FLOOR */
+        g_hostMathCalls++;
+        return VM_FloatToInt(floorf(VMF(1)));
+
     default:
         fprintf(stderr, "Bad system call: %ld\n", (long int)args[0]);
     }